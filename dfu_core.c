@@ -0,0 +1,1330 @@
+/*
+ * dfu_core.c
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * USB control transfer engine shared by the USB Device Firmware Upgrade drivers
+ *
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <crypto/sha2.h>
+#include "usbdfu.h"
+
+#define CREATE_TRACE_POINTS
+#include "dfu_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(dfu_poll);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Dashi Cao");
+MODULE_DESCRIPTION("USB DFU Transport Core");
+
+static int cache_size = 16; /* MiB */
+module_param(cache_size, int, 0644);
+MODULE_PARM_DESC(cache_size, "Memory for recently flashed images, 0 turns "
+	"the cache off. Default: 16 MiB");
+
+static LIST_HEAD(dfu_cache);
+static DEFINE_MUTEX(dfu_cache_lock);
+static size_t dfu_cache_bytes;
+static int dfu_cache_count;
+static unsigned long dfu_cache_hits, dfu_cache_misses;
+static struct dentry *dfu_debugfs;
+
+static void dfu_chain_cancel(struct dfu_control *ctrl, int status)
+{
+	struct dfu_control *next;
+
+	while (ctrl) {
+		next = ctrl->next;
+		ctrl->status = status;
+		ctrl->done = ktime_get();
+		if (ctrl->complete)
+			ctrl->complete(ctrl);
+		complete(&ctrl->urbdone);
+		ctrl = next;
+	}
+}
+
+static int dfu_start_urb(struct dfu_control *ctrl, gfp_t mem_flags);
+static void dfu_rec_urb(struct dfu_control *ctrl, int status, s64 usecs);
+
+static void dfu_ctrlurb_done(struct urb *urb)
+{
+	struct dfu_control *ctrl, *next;
+
+	ctrl = urb->context;
+	next = ctrl->next;
+	ctrl->status = urb->status;
+	ctrl->nxfer = urb->actual_length;
+	ctrl->done = ktime_get();
+	if (next) {
+		if (ctrl->status == 0)
+			dfu_start_urb(next, GFP_ATOMIC);
+		else
+			dfu_chain_cancel(next, -ECANCELED);
+	}
+	if (ctrl->complete)
+		ctrl->complete(ctrl);
+	complete(&ctrl->urbdone);
+}
+
+static int dfu_start_urb(struct dfu_control *ctrl, gfp_t mem_flags)
+{
+	int retusb;
+
+	usb_fill_control_urb(ctrl->dfurb, ctrl->usbdev, ctrl->pipe,
+			(__u8 *)&ctrl->req, ctrl->datbuf, ctrl->len,
+			dfu_ctrlurb_done, ctrl);
+	if (ctrl->anchor)
+		usb_anchor_urb(ctrl->dfurb, ctrl->anchor);
+	ctrl->start = ktime_get();
+	retusb = usb_submit_urb(ctrl->dfurb, mem_flags);
+	if (retusb) {
+		if (ctrl->anchor)
+			usb_unanchor_urb(ctrl->dfurb);
+		dev_err(&ctrl->intf->dev,
+			"URB type: %2.2x, req: %2.2x submit failed: %d\n",
+			(int)ctrl->req.bRequestType,
+			(int)ctrl->req.bRequest, retusb);
+		dfu_chain_cancel(ctrl, retusb);
+	}
+	return retusb;
+}
+
+static void dfu_urb_timeout(struct dfu_control *ctrl)
+{
+	usb_unlink_urb(ctrl->dfurb);
+	wait_for_completion(&ctrl->urbdone);
+	if (ctrl->req.bRequest != USB_DFU_ABORT)
+		dev_err(&ctrl->intf->dev,
+			"URB req type: %2.2x, req: %2.2x cancelled\n",
+			(int)ctrl->req.bRequestType,
+			(int)ctrl->req.bRequest);
+}
+
+int dfu_submit_async(struct dfu_control *ctrl, struct usb_anchor *anchor,
+		gfp_t mem_flags)
+{
+	struct dfu_control *cur;
+
+	for (cur = ctrl; cur; cur = cur->next) {
+		init_completion(&cur->urbdone);
+		cur->status = USB_DFU_ERROR_CODE;
+		cur->nxfer = 0;
+		cur->anchor = anchor;
+		cur->start = ktime_get();
+		cur->done = cur->start;
+	}
+	return dfu_start_urb(ctrl, mem_flags);
+}
+EXPORT_SYMBOL_GPL(dfu_submit_async);
+
+int dfu_wait_urb(struct dfu_control *ctrl, int tmout)
+{
+	struct dfu_control *cur;
+	unsigned long jiff_wait;
+	int retv, status, cls;
+	s64 usecs;
+
+	retv = 0;
+	for (cur = ctrl; cur; cur = cur->next) {
+		cls = cur->req.bRequest;
+		if (cur->rto)
+			jiff_wait = msecs_to_jiffies(dfu_rto_get(cur->rto, cls,
+						cur->len));
+		else
+			jiff_wait = msecs_to_jiffies(tmout);
+		if (!wait_for_completion_timeout(&cur->urbdone, jiff_wait)) {
+			dfu_urb_timeout(cur);
+			if (cur->rto)
+				dfu_rto_expired(cur->rto, cls);
+		}
+		status = READ_ONCE(cur->status);
+		usecs = ktime_us_delta(cur->done, cur->start);
+		trace_dfu_urb(cur);
+		if (cur->rto && status == 0)
+			dfu_rto_sample(cur->rto, cls, cur->len, usecs);
+		if (cur->stats) {
+			dfu_stats_urb(cur->stats, cls,
+				cur->req.bRequestType & USB_DIR_IN,
+				cls == USB_DFU_DNLOAD || cls == USB_DFU_UPLOAD?
+				cur->nxfer : 0, status, usecs);
+			dfu_rec_urb(cur, status, usecs);
+		}
+		if (retv || status == 0)
+			continue;
+		retv = status;
+		if (cur->req.bRequest != USB_DFU_ABORT)
+			dev_err(&cur->intf->dev,
+				"URB type: %2.2x, req: %2.2x request failed: "
+				"%d\n", (int)cur->req.bRequestType,
+				(int)cur->req.bRequest, retv);
+	}
+	return retv;
+}
+EXPORT_SYMBOL_GPL(dfu_wait_urb);
+
+int dfu_submit_urb(struct dfu_control *ctrl, int tmout)
+{
+	int retv;
+
+	ctrl->next = NULL;
+	ctrl->complete = NULL;
+	retv = dfu_submit_async(ctrl, NULL, GFP_KERNEL);
+	if (retv == 0)
+		retv = dfu_wait_urb(ctrl, tmout);
+	return retv;
+}
+EXPORT_SYMBOL_GPL(dfu_submit_urb);
+
+int dfu_wait_anchor(struct usb_anchor *anchor, int tmout)
+{
+	if (usb_wait_anchor_empty_timeout(anchor, tmout))
+		return 0;
+	usb_kill_anchored_urbs(anchor);
+	return -ETIMEDOUT;
+}
+EXPORT_SYMBOL_GPL(dfu_wait_anchor);
+
+static const char *const dfu_class_names[DFU_RTO_CLASSES] = {
+	"DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE",
+	"ABORT", NULL
+};
+
+void dfu_rto_init(struct dfu_rto *rto, int init_ms)
+{
+	int i;
+
+	spin_lock_init(&rto->lock);
+	memset(rto->cls, 0, sizeof(rto->cls));
+	for (i = 0; i < DFU_RTO_CLASSES; i++)
+		rto->cls[i].init_ms = init_ms;
+	rto->min_ms = init_ms > DFU_RTO_MIN_MS? init_ms : DFU_RTO_MIN_MS;
+}
+EXPORT_SYMBOL_GPL(dfu_rto_init);
+
+static inline unsigned int dfu_rto_units(int len)
+{
+	return 1 + len / DFU_RTO_UNIT;
+}
+
+static int dfu_rto_calc(struct dfu_rto_class *rc, int len, int min_ms)
+{
+	u64 usecs;
+	int tmout;
+
+	if (rc->samples == 0)
+		tmout = rc->init_ms;
+	else {
+		usecs = (u64)((rc->srtt >> 3) + rc->rttvar) *
+			dfu_rto_units(len);
+		tmout = DIV_ROUND_UP_ULL(usecs, USEC_PER_MSEC);
+	}
+	tmout <<= rc->backoff;
+	if (tmout < min_ms)
+		tmout = min_ms;
+	if (tmout > DFU_RTO_MAX_MS)
+		tmout = DFU_RTO_MAX_MS;
+	return tmout;
+}
+
+int dfu_rto_get(struct dfu_rto *rto, int cls, int len)
+{
+	int tmout;
+
+	if (cls < 0 || cls >= DFU_RTO_CLASSES)
+		return DFU_RTO_MAX_MS;
+	spin_lock(&rto->lock);
+	tmout = dfu_rto_calc(rto->cls + cls, len, rto->min_ms);
+	spin_unlock(&rto->lock);
+	return tmout;
+}
+EXPORT_SYMBOL_GPL(dfu_rto_get);
+
+void dfu_rto_sample(struct dfu_rto *rto, int cls, int len, s64 usecs)
+{
+	struct dfu_rto_class *rc;
+	int delta;
+	u32 m;
+
+	if (cls < 0 || cls >= DFU_RTO_CLASSES || usecs < 0)
+		return;
+	m = div_u64(usecs, dfu_rto_units(len));
+	if (m > DFU_RTO_MAX_MS * USEC_PER_MSEC)
+		m = DFU_RTO_MAX_MS * USEC_PER_MSEC;
+	rc = rto->cls + cls;
+	spin_lock(&rto->lock);
+	if (rc->samples == 0) {
+		rc->srtt = m << 3;
+		rc->rttvar = m << 1;
+	} else {
+		delta = m - (rc->srtt >> 3);
+		rc->srtt += delta;
+		rc->rttvar += abs(delta) - (rc->rttvar >> 2);
+	}
+	rc->samples += 1;
+	rc->backoff = 0;
+	spin_unlock(&rto->lock);
+}
+EXPORT_SYMBOL_GPL(dfu_rto_sample);
+
+void dfu_rto_expired(struct dfu_rto *rto, int cls)
+{
+	if (cls < 0 || cls >= DFU_RTO_CLASSES)
+		return;
+	spin_lock(&rto->lock);
+	if (rto->cls[cls].backoff < DFU_RTO_MAXSHIFT)
+		rto->cls[cls].backoff += 1;
+	spin_unlock(&rto->lock);
+}
+EXPORT_SYMBOL_GPL(dfu_rto_expired);
+
+ssize_t dfu_rto_show(struct dfu_rto *rto, const char *const *names,
+		char *buf)
+{
+	struct dfu_rto_class rc;
+	ssize_t len;
+	int i;
+
+	if (!names)
+		names = dfu_class_names;
+	len = 0;
+	for (i = 0; i < DFU_RTO_CLASSES; i++) {
+		if (!names[i])
+			continue;
+		spin_lock(&rto->lock);
+		rc = rto->cls[i];
+		spin_unlock(&rto->lock);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"%s: Samples: %u Srtt: %u us Mdev: %u us "
+			"Backoff: %u Timeout: %d ms\n", names[i], rc.samples,
+			rc.srtt >> 3, rc.rttvar >> 2, rc.backoff,
+			dfu_rto_calc(&rc, 0, rto->min_ms));
+	}
+	return len;
+}
+EXPORT_SYMBOL_GPL(dfu_rto_show);
+
+static void dfu_stats_sum(struct dfu_stats *stats, struct dfu_stats_cpu *sum)
+{
+	struct dfu_stats_cpu *sc;
+	u64 *dst, *src;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(stats->cpu, cpu);
+		dst = (u64 *)sum;
+		src = (u64 *)sc;
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			dst[i] += READ_ONCE(src[i]);
+	}
+}
+
+static int dfu_stats_seq_show(struct seq_file *m, void *v)
+{
+	struct dfu_stats *stats = m->private;
+	struct dfu_stats_cpu *sum;
+	u64 bytes, usecs, count;
+	unsigned long sessions;
+	int i, b;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	dfu_stats_sum(stats, sum);
+	spin_lock(&stats->lock);
+	bytes = stats->last_bytes;
+	usecs = stats->last_usecs;
+	sessions = stats->sessions;
+	spin_unlock(&stats->lock);
+
+	seq_printf(m, "Bytes: out %llu in %llu\n", sum->bytes[0],
+			sum->bytes[1]);
+	seq_printf(m, "Blocks: out %llu in %llu\n", sum->blocks[0],
+			sum->blocks[1]);
+	seq_printf(m, "Busy: %llu waits %llu us, bwPollTimeout %llu us\n",
+			sum->busy_waits, sum->busy_us, sum->poll_us);
+	seq_printf(m, "Polls: %llu\n", sum->polls);
+	seq_printf(m, "Sessions: %lu Last: %llu bytes %llu us", sessions,
+			bytes, usecs);
+	if (usecs)
+		seq_printf(m, " %llu.%03llu MB/s", div64_u64(bytes, usecs),
+				div64_u64(bytes * 1000, usecs) % 1000);
+	seq_putc(m, '\n');
+	for (i = 0; i < DFU_RTO_CLASSES; i++) {
+		if (!stats->names[i])
+			continue;
+		count = 0;
+		for (b = 0; b < DFU_HIST_BUCKETS; b++)
+			count += sum->hist[i][b];
+		if (count == 0 && sum->errors[i] == 0)
+			continue;
+		seq_printf(m, "%s: %llu errors %llu", stats->names[i],
+				count, sum->errors[i]);
+		for (b = 0; b < DFU_HIST_BUCKETS; b++) {
+			if (sum->hist[i][b] == 0)
+				continue;
+			if (b == DFU_HIST_BUCKETS - 1)
+				seq_printf(m, " >=%lluus:%llu",
+					1ull << (b + DFU_HIST_SHIFT - 1),
+					sum->hist[i][b]);
+			else
+				seq_printf(m, " <%lluus:%llu",
+					1ull << (b + DFU_HIST_SHIFT),
+					sum->hist[i][b]);
+		}
+		seq_putc(m, '\n');
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int dfu_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dfu_stats_seq_show, inode->i_private);
+}
+
+/* Any write zeroes the counters */
+static ssize_t dfu_stats_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct dfu_stats *stats;
+	int cpu;
+
+	stats = ((struct seq_file *)file->private_data)->private;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats->cpu, cpu), 0,
+				sizeof(struct dfu_stats_cpu));
+	spin_lock(&stats->lock);
+	stats->sess_base = 0;
+	stats->last_bytes = 0;
+	stats->last_usecs = 0;
+	stats->sessions = 0;
+	spin_unlock(&stats->lock);
+	return count;
+}
+
+static const struct file_operations dfu_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = dfu_stats_open,
+	.read = seq_read,
+	.write = dfu_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void dfu_rec_add(struct dfu_stats *stats, int cls, int value, int len,
+		int nxfer, int status, ktime_t start, s64 usecs,
+		int bstatus, int bstate)
+{
+	struct dfu_recorder *rec = &stats->rec;
+	struct dfu_rec_entry *e;
+	unsigned long seq;
+
+	seq = atomic_long_inc_return(&rec->head);
+	e = rec->ent + ((seq - 1) & (DFU_REC_SIZE - 1));
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->ts = ktime_to_ns(start);
+	e->usecs = usecs;
+	e->status = status;
+	e->value = value;
+	e->len = len;
+	e->nxfer = nxfer;
+	e->cls = cls;
+	e->bstatus = bstatus;
+	e->bstate = bstate;
+	smp_wmb();
+	WRITE_ONCE(e->seq, seq);
+	if (bstate != DFU_REC_NOSTATE)
+		WRITE_ONCE(rec->state, bstate);
+}
+EXPORT_SYMBOL_GPL(dfu_rec_add);
+
+/*
+ * Wake select() on attr and send a KOBJ_CHANGE uevent carrying the
+ * variable formatted from fmt, plus DFU_STATE and DFU_DONE once the
+ * snapshot holds a state. Must be called from process context.
+ */
+void dfu_snap_announce(struct dfu_stats *stats, const char *attr,
+		const char *fmt, ...)
+{
+	struct dfu_snapval snap;
+	char var[32], state[24], done[32];
+	char *envp[4];
+	va_list args;
+	int n;
+
+	if (attr)
+		sysfs_notify(&stats->dev->kobj, NULL, attr);
+	dfu_snap_read(stats, &snap);
+	n = 0;
+	if (fmt) {
+		va_start(args, fmt);
+		vsnprintf(var, sizeof(var), fmt, args);
+		va_end(args);
+		envp[n++] = var;
+	}
+	if (snap.when) {
+		snprintf(state, sizeof(state), "DFU_STATE=%d", snap.bstate);
+		snprintf(done, sizeof(done), "DFU_DONE=%llu", snap.done);
+		envp[n++] = state;
+		envp[n++] = done;
+	}
+	envp[n] = NULL;
+	kobject_uevent_env(&stats->dev->kobj, KOBJ_CHANGE, envp);
+}
+EXPORT_SYMBOL_GPL(dfu_snap_announce);
+
+/*
+ * The three download states alternate on every block, so they count as
+ * one phase; only a change of phase is announced to user space.
+ */
+static int dfu_snap_phase(int bstate)
+{
+	switch (bstate) {
+	case dfuDNLOAD_SYNC:
+	case dfuDNLOAD_BUSY:
+		return dfuDNLOAD_IDLE;
+	case dfuMANIFEST_SYNC:
+		return dfuMANIFEST;
+	default:
+		return bstate;
+	}
+}
+
+static void dfu_snap_update(struct dfu_stats *stats, int bstatus,
+		int bstate, int wmsec, int bytes)
+{
+	struct dfu_snapval *v = &stats->snap.v;
+	int phase, changed, status;
+
+	changed = 0;
+	write_seqlock(&stats->snap.lock);
+	if (bstate != DFU_REC_NOSTATE) {
+		v->bstate = bstate;
+		v->when = ktime_get();
+		phase = dfu_snap_phase(bstate);
+		changed = phase != stats->snap.phase;
+		stats->snap.phase = phase;
+	}
+	if (bstatus != DFU_REC_NOSTATE) {
+		v->bstatus = bstatus;
+		v->wmsec = wmsec;
+	}
+	v->done += bytes;
+	status = v->bstatus;
+	write_sequnlock(&stats->snap.lock);
+	if (changed && stats->notify)
+		dfu_snap_announce(stats, stats->notify, "DFU_STATUS=%d",
+				status);
+}
+
+void dfu_snap_state(struct dfu_stats *stats, int bstate)
+{
+	dfu_snap_update(stats, DFU_REC_NOSTATE, bstate, 0, 0);
+}
+EXPORT_SYMBOL_GPL(dfu_snap_state);
+
+void dfu_snap_read(struct dfu_stats *stats, struct dfu_snapval *val)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&stats->snap.lock);
+		*val = stats->snap.v;
+	} while (read_seqretry(&stats->snap.lock, seq));
+}
+EXPORT_SYMBOL_GPL(dfu_snap_read);
+
+static void dfu_rec_urb(struct dfu_control *ctrl, int status, s64 usecs)
+{
+	struct dfu_status *dfust;
+	int cls, bstatus, bstate, wmsec, bytes;
+
+	cls = ctrl->req.bRequest;
+	bstatus = DFU_REC_NOSTATE;
+	bstate = DFU_REC_NOSTATE;
+	wmsec = 0;
+	if (status == 0 && cls == USB_DFU_GETSTATUS &&
+			ctrl->nxfer >= sizeof(struct dfu_status)) {
+		dfust = ctrl->datbuf;
+		bstatus = dfust->bStatus;
+		bstate = dfust->bState;
+		wmsec = wmsec2int(dfust->wmsec);
+	} else if (status == 0 && cls == USB_DFU_GETSTATE &&
+			ctrl->nxfer >= 1) {
+		bstate = *(u8 *)ctrl->datbuf;
+	}
+	dfu_rec_add(ctrl->stats, cls, le16_to_cpu(ctrl->req.wValue),
+			ctrl->len, ctrl->nxfer, status, ctrl->start, usecs,
+			bstatus, bstate);
+
+	bytes = 0;
+	if (status == 0 && (cls == USB_DFU_DNLOAD || cls == USB_DFU_UPLOAD))
+		bytes = ctrl->nxfer;
+	if (status == 0 && (cls == USB_DFU_CLRSTATUS || cls == USB_DFU_ABORT))
+		bstate = dfuIDLE;
+	if (bstate != DFU_REC_NOSTATE || bytes)
+		dfu_snap_update(ctrl->stats, bstatus, bstate, wmsec, bytes);
+}
+
+/*
+ * Copy out entry seq, or return 0 if it has been overwritten or is being
+ * written.
+ */
+static int dfu_rec_get(struct dfu_recorder *rec, unsigned long seq,
+		struct dfu_rec_entry *copy)
+{
+	struct dfu_rec_entry *e;
+
+	e = rec->ent + ((seq - 1) & (DFU_REC_SIZE - 1));
+	if (READ_ONCE(e->seq) != seq)
+		return 0;
+	smp_rmb();
+	*copy = *e;
+	smp_rmb();
+	return READ_ONCE(e->seq) == seq;
+}
+
+static void dfu_rec_format(struct dfu_stats *stats, struct dfu_rec_entry *e,
+		char *line, int size)
+{
+	const char *name;
+	u64 ts;
+	u32 rem;
+
+	name = e->cls < DFU_RTO_CLASSES? stats->names[e->cls] : NULL;
+	ts = div_u64_rem(e->ts, NSEC_PER_SEC, &rem);
+	snprintf(line, size, "%5llu.%06u %-9s value=%u len=%u xfer=%u "
+		"status=%d state=%d/%d %u us", ts, rem / 1000,
+		name? name : "?", e->value, e->len, e->nxfer, e->status,
+		e->bstate == DFU_REC_NOSTATE? -1 : e->bstate,
+		e->bstatus == DFU_REC_NOSTATE? -1 : e->bstatus, e->usecs);
+}
+
+void dfu_rec_dump(struct dfu_stats *stats)
+{
+	struct dfu_recorder *rec = &stats->rec;
+	struct dfu_rec_entry e;
+	unsigned long head, seq;
+	char line[128];
+
+	head = atomic_long_read(&rec->head);
+	seq = head > DFU_REC_SIZE? head - DFU_REC_SIZE + 1 : 1;
+	dev_warn(stats->dev, "Last %lu transactions:\n", head - seq + 1);
+	for (; seq <= head; seq++) {
+		if (!dfu_rec_get(rec, seq, &e))
+			continue;
+		dfu_rec_format(stats, &e, line, sizeof(line));
+		dev_warn(stats->dev, "%s\n", line);
+	}
+}
+EXPORT_SYMBOL_GPL(dfu_rec_dump);
+
+static int dfu_rec_seq_show(struct seq_file *m, void *v)
+{
+	struct dfu_stats *stats = m->private;
+	struct dfu_recorder *rec = &stats->rec;
+	struct dfu_rec_entry e;
+	unsigned long head, seq;
+	char line[128];
+
+	head = atomic_long_read(&rec->head);
+	seq = head > DFU_REC_SIZE? head - DFU_REC_SIZE + 1 : 1;
+	for (; seq <= head; seq++) {
+		if (!dfu_rec_get(rec, seq, &e))
+			continue;
+		dfu_rec_format(stats, &e, line, sizeof(line));
+		seq_printf(m, "%s\n", line);
+	}
+	return 0;
+}
+
+static int dfu_rec_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dfu_rec_seq_show, inode->i_private);
+}
+
+static const struct file_operations dfu_rec_fops = {
+	.owner = THIS_MODULE,
+	.open = dfu_rec_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int dfu_stats_init(struct dfu_stats *stats, struct usb_interface *intf,
+		const char *const *names)
+{
+	stats->cpu = alloc_percpu(struct dfu_stats_cpu);
+	if (!stats->cpu)
+		return -ENOMEM;
+	spin_lock_init(&stats->lock);
+	stats->names = names? names : dfu_class_names;
+	stats->sess_start = 0;
+	stats->sess_base = 0;
+	stats->last_bytes = 0;
+	stats->last_usecs = 0;
+	stats->sessions = 0;
+	stats->dev = &intf->dev;
+	memset(&stats->rec, 0, sizeof(stats->rec));
+	stats->rec.state = -1;
+	seqlock_init(&stats->snap.lock);
+	memset(&stats->snap.v, 0, sizeof(stats->snap.v));
+	stats->snap.v.bstatus = -1;
+	stats->snap.v.bstate = -1;
+	stats->snap.phase = -1;
+	stats->notify = NULL;
+	stats->dir = debugfs_create_dir(dev_name(&intf->dev), dfu_debugfs);
+	debugfs_create_file("stats", 0600, stats->dir, stats,
+			&dfu_stats_fops);
+	debugfs_create_file("recorder", 0400, stats->dir, stats,
+			&dfu_rec_fops);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dfu_stats_init);
+
+void dfu_stats_destroy(struct dfu_stats *stats)
+{
+	debugfs_remove_recursive(stats->dir);
+	stats->dir = NULL;
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+EXPORT_SYMBOL_GPL(dfu_stats_destroy);
+
+void dfu_stats_urb(struct dfu_stats *stats, int cls, int in, int len,
+		int status, s64 usecs)
+{
+	struct dfu_stats_cpu __percpu *sc = stats->cpu;
+	int b;
+
+	if (cls < 0 || cls >= DFU_RTO_CLASSES)
+		return;
+	if (status) {
+		this_cpu_inc(sc->errors[cls]);
+		return;
+	}
+	in = in? 1 : 0;
+	if (len > 0) {
+		this_cpu_add(sc->bytes[in], len);
+		this_cpu_inc(sc->blocks[in]);
+	}
+	b = usecs > 0? fls64(usecs) - DFU_HIST_SHIFT : 0;
+	if (b < 0)
+		b = 0;
+	if (b >= DFU_HIST_BUCKETS)
+		b = DFU_HIST_BUCKETS - 1;
+	this_cpu_inc(sc->hist[cls][b]);
+}
+EXPORT_SYMBOL_GPL(dfu_stats_urb);
+
+static u64 dfu_stats_bytes(struct dfu_stats *stats)
+{
+	struct dfu_stats_cpu *sc;
+	u64 bytes;
+	int cpu;
+
+	bytes = 0;
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(stats->cpu, cpu);
+		bytes += READ_ONCE(sc->bytes[0]) + READ_ONCE(sc->bytes[1]);
+	}
+	return bytes;
+}
+
+void dfu_stats_begin(struct dfu_stats *stats)
+{
+	u64 bytes;
+
+	bytes = dfu_stats_bytes(stats);
+	spin_lock(&stats->lock);
+	stats->sess_start = ktime_get();
+	stats->sess_base = bytes;
+	spin_unlock(&stats->lock);
+	write_seqlock(&stats->snap.lock);
+	stats->snap.v.done = 0;
+	write_sequnlock(&stats->snap.lock);
+}
+EXPORT_SYMBOL_GPL(dfu_stats_begin);
+
+void dfu_stats_end(struct dfu_stats *stats)
+{
+	u64 bytes;
+	int ended;
+
+	bytes = dfu_stats_bytes(stats);
+	spin_lock(&stats->lock);
+	ended = stats->sess_start != 0;
+	if (ended) {
+		stats->last_bytes = bytes - stats->sess_base;
+		stats->last_usecs = ktime_us_delta(ktime_get(),
+				stats->sess_start);
+		stats->sessions += 1;
+		stats->sess_start = 0;
+	}
+	spin_unlock(&stats->lock);
+	if (ended && READ_ONCE(stats->rec.state) == dfuERROR) {
+		dev_warn(stats->dev, "Session ended in dfuERROR\n");
+		dfu_rec_dump(stats);
+	}
+}
+EXPORT_SYMBOL_GPL(dfu_stats_end);
+
+ktime_t dfu_pace_begin(struct dfu_pacer *pacer, int tmout, int learn)
+{
+	unsigned int wait_us;
+	int limit;
+
+	pacer->start = ktime_get();
+	limit = 5 * tmout > DFU_PACE_DEADLINE_MS? 5 * tmout :
+		DFU_PACE_DEADLINE_MS;
+	pacer->deadline = ktime_add_ms(pacer->start, limit);
+	pacer->polls = 0;
+	pacer->learn = learn;
+	pacer->tmout = tmout;
+	wait_us = tmout * USEC_PER_MSEC;
+	if (learn && pacer->busy_us && pacer->busy_us < wait_us)
+		wait_us = pacer->busy_us;
+	if (wait_us < DFU_PACE_MIN_US)
+		wait_us = DFU_PACE_MIN_US;
+	return ktime_add_us(pacer->start, wait_us);
+}
+EXPORT_SYMBOL_GPL(dfu_pace_begin);
+
+ktime_t dfu_pace_next(struct dfu_pacer *pacer, int tmout)
+{
+	unsigned int wait_us;
+
+	pacer->polls += 1;
+	wait_us = tmout * USEC_PER_MSEC;
+	if (wait_us < DFU_PACE_MIN_US)
+		wait_us = DFU_PACE_MIN_US;
+	return ktime_add_us(ktime_get(), wait_us);
+}
+EXPORT_SYMBOL_GPL(dfu_pace_next);
+
+void dfu_pace_end(struct dfu_pacer *pacer)
+{
+	struct dfu_stats_cpu __percpu *sc;
+	unsigned int elapsed;
+
+	elapsed = ktime_us_delta(ktime_get(), pacer->start);
+	if (pacer->stats) {
+		sc = pacer->stats->cpu;
+		this_cpu_add(sc->polls, pacer->polls + 1);
+		if (pacer->learn) {
+			this_cpu_inc(sc->busy_waits);
+			this_cpu_add(sc->busy_us, elapsed);
+			this_cpu_add(sc->poll_us,
+					(u64)pacer->tmout * USEC_PER_MSEC);
+		}
+	}
+	if (!pacer->learn)
+		return;
+	pacer->learn = 0;
+	if (pacer->busy_us == 0)
+		pacer->busy_us = elapsed;
+	else if (pacer->polls == 0)
+		pacer->busy_us -= pacer->busy_us >> 3;
+	else
+		pacer->busy_us += (elapsed >> 3) - (pacer->busy_us >> 3);
+}
+EXPORT_SYMBOL_GPL(dfu_pace_end);
+
+void dfu_pace_sleep(ktime_t until)
+{
+	s64 delta;
+
+	delta = ktime_us_delta(until, ktime_get());
+	if (delta > 0)
+		usleep_range(delta, delta + (delta >> 3) + 50);
+}
+EXPORT_SYMBOL_GPL(dfu_pace_sleep);
+
+int dfu_pool_init(struct dfu_pool *pool, struct usb_interface *intf, int size)
+{
+	struct urb *urb;
+	int i;
+
+	if (size > BITS_PER_LONG)
+		size = BITS_PER_LONG;
+	spin_lock_init(&pool->lock);
+	pool->intf = intf;
+	pool->rto = NULL;
+	pool->stats = NULL;
+	pool->freemap = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+	pool->size = 0;
+	pool->ctrls = kcalloc(size, sizeof(struct dfu_control), GFP_KERNEL);
+	if (!pool->ctrls)
+		return -ENOMEM;
+	for (i = 0; i < size; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			dfu_pool_destroy(pool);
+			return -ENOMEM;
+		}
+		dfu_init_control(pool->ctrls + i, intf, urb);
+		pool->freemap |= 1ul << i;
+		pool->size += 1;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dfu_pool_init);
+
+void dfu_pool_destroy(struct dfu_pool *pool)
+{
+	int i;
+
+	WARN_ON(hweight_long(pool->freemap) != pool->size);
+	for (i = 0; i < pool->size; i++)
+		usb_free_urb(pool->ctrls[i].dfurb);
+	kfree(pool->ctrls);
+	pool->ctrls = NULL;
+	pool->freemap = 0;
+	pool->size = 0;
+}
+EXPORT_SYMBOL_GPL(dfu_pool_destroy);
+
+struct dfu_control *dfu_pool_get(struct dfu_pool *pool)
+{
+	struct dfu_control *ctrl;
+	struct urb *urb;
+	int i;
+
+	spin_lock(&pool->lock);
+	if (pool->freemap) {
+		i = __ffs(pool->freemap);
+		pool->freemap &= ~(1ul << i);
+		pool->hits += 1;
+		spin_unlock(&pool->lock);
+		ctrl = pool->ctrls + i;
+		dfu_init_control(ctrl, pool->intf, ctrl->dfurb);
+		ctrl->rto = pool->rto;
+		ctrl->stats = pool->stats;
+		return ctrl;
+	}
+	pool->misses += 1;
+	spin_unlock(&pool->lock);
+
+	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
+	if (!ctrl)
+		return NULL;
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		kfree(ctrl);
+		return NULL;
+	}
+	dfu_init_control(ctrl, pool->intf, urb);
+	ctrl->rto = pool->rto;
+	ctrl->stats = pool->stats;
+	return ctrl;
+}
+EXPORT_SYMBOL_GPL(dfu_pool_get);
+
+void dfu_pool_put(struct dfu_pool *pool, struct dfu_control *ctrl)
+{
+	int i;
+
+	if (ctrl >= pool->ctrls && ctrl < pool->ctrls + pool->size) {
+		i = ctrl - pool->ctrls;
+		spin_lock(&pool->lock);
+		pool->freemap |= 1ul << i;
+		spin_unlock(&pool->lock);
+	} else {
+		usb_free_urb(ctrl->dfurb);
+		kfree(ctrl);
+	}
+}
+EXPORT_SYMBOL_GPL(dfu_pool_put);
+
+ssize_t dfu_pool_show(struct dfu_pool *pool, char *buf)
+{
+	unsigned long hits, misses;
+	int nfree;
+
+	spin_lock(&pool->lock);
+	hits = pool->hits;
+	misses = pool->misses;
+	nfree = hweight_long(pool->freemap);
+	spin_unlock(&pool->lock);
+	return sprintf(buf, "Hits: %lu Misses: %lu Free: %d/%d\n",
+			hits, misses, nfree, pool->size);
+}
+EXPORT_SYMBOL_GPL(dfu_pool_show);
+
+static int dfu_sweep_idle(struct dfu_control *ctrl, int tmout)
+{
+	int request, retv;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATE, 0,
+			&ctrl->dfuState, sizeof(ctrl->dfuState));
+	retv = dfu_submit_urb(ctrl, tmout);
+	if (retv)
+		return retv;
+	switch (ctrl->dfuState) {
+	case dfuIDLE:
+		return 0;
+	case dfuUPLOAD_IDLE:
+		request = USB_DFU_ABORT;
+		break;
+	case dfuERROR:
+		request = USB_DFU_CLRSTATUS;
+		break;
+	default:
+		return -EPROTO;
+	}
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, request, 0, NULL, 0);
+	return dfu_submit_urb(ctrl, tmout);
+}
+
+static long dfu_sweep_one(struct dfu_control *ctrl, void *datbuf, int size,
+		int tmout)
+{
+	unsigned long nbytes;
+	ktime_t start;
+	s64 usecs;
+	int blknum, retv;
+
+	retv = dfu_sweep_idle(ctrl, tmout);
+	if (retv)
+		return retv;
+	nbytes = 0;
+	blknum = 0;
+	start = ktime_get();
+	while (nbytes < DFU_SWEEP_BYTES) {
+		dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_UPLOAD, blknum,
+				datbuf, size);
+		retv = dfu_submit_urb(ctrl, tmout);
+		if (retv)
+			break;
+		nbytes += ctrl->nxfer;
+		blknum += 1;
+		if (ctrl->nxfer < size)
+			break;
+	}
+	usecs = ktime_us_delta(ktime_get(), start);
+	if (retv) {
+		dfu_sweep_idle(ctrl, tmout);
+		return retv;
+	}
+	retv = dfu_sweep_idle(ctrl, tmout);
+	if (retv)
+		return retv;
+	if (usecs <= 0)
+		usecs = 1;
+	return div64_u64((u64)nbytes * USEC_PER_SEC, (u64)usecs << 10);
+}
+
+ssize_t dfu_xfersize_sweep(struct dfu_control *ctrl, int wxfersize, int tmout,
+		char *buf)
+{
+	int sizes[16];
+	int i, nsize, size, limit, best;
+	long rate, best_rate;
+	void *datbuf;
+	ssize_t len;
+
+	/*
+	 * Candidates are the powers of two from the ep0 packet size up to
+	 * four times wTransferSize, with wTransferSize itself slotted in.
+	 */
+	limit = 4 * wxfersize < DFU_SWEEP_MAXSIZE? 4 * wxfersize :
+		DFU_SWEEP_MAXSIZE;
+	nsize = 0;
+	for (size = usb_endpoint_maxp(&ctrl->usbdev->ep0.desc);
+			size > 0 && size <= limit &&
+			nsize < ARRAY_SIZE(sizes) - 2; size <<= 1) {
+		if (wxfersize < size &&
+				(nsize == 0 || sizes[nsize-1] < wxfersize))
+			sizes[nsize++] = wxfersize;
+		sizes[nsize++] = size;
+	}
+	if (nsize == 0 || sizes[nsize-1] < wxfersize)
+		sizes[nsize++] = wxfersize;
+
+	datbuf = kmalloc(sizes[nsize-1], GFP_KERNEL);
+	if (!datbuf)
+		return -ENOMEM;
+	len = 0;
+	best = 0;
+	best_rate = 0;
+	for (i = 0; i < nsize; i++) {
+		rate = dfu_sweep_one(ctrl, datbuf, sizes[i], tmout);
+		if (rate < 0) {
+			len += sprintf(buf+len, "%d: failed %ld\n", sizes[i],
+					rate);
+			continue;
+		}
+		len += sprintf(buf+len, "%d: %ld KiB/s\n", sizes[i], rate);
+		if (rate > best_rate) {
+			best_rate = rate;
+			best = sizes[i];
+		}
+	}
+	kfree(datbuf);
+	len += sprintf(buf+len, "Best: %d\n", best);
+	return len;
+}
+EXPORT_SYMBOL_GPL(dfu_xfersize_sweep);
+
+static inline int dfu_settling(int bstate)
+{
+	return bstate == dfuDNLOAD_SYNC || bstate == dfuDNLOAD_BUSY ||
+		bstate == dfuMANIFEST_SYNC || bstate == dfuMANIFEST;
+}
+
+/*
+ * GETSTATUS until the device has settled after a DNLOAD block or the
+ * final zero length one.
+ */
+static int dfu_settle(struct dfu_control *ctrl, struct dfu_pacer *pacer,
+		int tmout)
+{
+	struct dfu_status *status = &ctrl->dfuStatus;
+	ktime_t next;
+	int retv;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATUS, 0,
+			status, sizeof(*status));
+	retv = dfu_submit_urb(ctrl, tmout);
+	if (retv)
+		return retv;
+	if (!dfu_settling(status->bState))
+		return status->bState;
+	next = dfu_pace_begin(pacer, wmsec2int(status->wmsec),
+			status->bState == dfuDNLOAD_BUSY);
+	for (;;) {
+		if (dfu_pace_expired(pacer))
+			return -ETIMEDOUT;
+		dfu_pace_sleep(next);
+		dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATUS, 0,
+				status, sizeof(*status));
+		retv = dfu_submit_urb(ctrl, tmout);
+		if (retv)
+			return retv;
+		trace_dfu_poll(ctrl->intf, status, pacer->polls + 1);
+		if (!dfu_settling(status->bState))
+			break;
+		next = dfu_pace_next(pacer, wmsec2int(status->wmsec));
+	}
+	dfu_pace_end(pacer);
+	return status->bState;
+}
+
+/*
+ * After a failed download, clear dfuERROR or abort the download so the
+ * device is left in dfuIDLE.
+ */
+static void dfu_dnload_cleanup(struct dfu_control *ctrl, int tmout)
+{
+	int req;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATE, 0,
+			&ctrl->dfuState, sizeof(ctrl->dfuState));
+	if (dfu_submit_urb(ctrl, tmout))
+		return;
+	if (ctrl->dfuState == dfuERROR)
+		req = USB_DFU_CLRSTATUS;
+	else if (ctrl->dfuState == dfuDNLOAD_IDLE)
+		req = USB_DFU_ABORT;
+	else
+		return;
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, req, 0, NULL, 0);
+	dfu_submit_urb(ctrl, tmout);
+}
+
+int dfu_dnload_buffer(struct dfu_control *ctrl, const u8 *data, size_t size,
+		int xfersize, int tmout)
+{
+	struct dfu_pacer pacer;
+	size_t off;
+	void *bounce;
+	int blknum, len, retv;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATE, 0,
+			&ctrl->dfuState, sizeof(ctrl->dfuState));
+	retv = dfu_submit_urb(ctrl, tmout);
+	if (retv)
+		return retv;
+	if (ctrl->dfuState != dfuIDLE) {
+		dev_err(&ctrl->intf->dev, "Incompatible State: %d\n",
+				(int)ctrl->dfuState);
+		return -EPROTO;
+	}
+	bounce = kmalloc(xfersize, GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	memset(&pacer, 0, sizeof(pacer));
+	off = 0;
+	blknum = 0;
+	do {
+		len = size - off < xfersize? size - off : xfersize;
+		memcpy(bounce, data + off, len);
+		dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_DNLOAD,
+				blknum, len? bounce : NULL, len);
+		retv = dfu_submit_urb(ctrl, tmout);
+		if (retv)
+			break;
+		retv = dfu_settle(ctrl, &pacer, tmout);
+		if (retv < 0)
+			break;
+		if ((len > 0 && retv != dfuDNLOAD_IDLE) || (len == 0 &&
+				retv != dfuIDLE && retv != dfuMANIFEST_WAIT_RESET)) {
+			dev_err(&ctrl->intf->dev, "Downloading failed. " \
+					"DFU State: %d\n", retv);
+			retv = -EPROTO;
+			break;
+		}
+		off += len;
+		blknum += 1;
+	} while (len > 0);
+	kfree(bounce);
+	if (retv < 0)
+		dfu_dnload_cleanup(ctrl, tmout);
+	return retv;
+}
+EXPORT_SYMBOL_GPL(dfu_dnload_buffer);
+
+size_t dfu_cache_limit(void)
+{
+	int mib = READ_ONCE(cache_size);
+
+	return mib > 0? (size_t)mib << 20 : 0;
+}
+EXPORT_SYMBOL_GPL(dfu_cache_limit);
+
+static void dfu_image_free(struct kref *ref)
+{
+	struct dfu_image *img;
+
+	img = container_of(ref, struct dfu_image, ref);
+	kvfree(img->data);
+	kfree(img);
+}
+
+/* Called with dfu_cache_lock held */
+static void dfu_cache_evict(size_t limit)
+{
+	struct dfu_image *img, *tmp;
+
+	list_for_each_entry_safe_reverse(img, tmp, &dfu_cache, lru) {
+		if (dfu_cache_bytes <= limit)
+			break;
+		list_del(&img->lru);
+		dfu_cache_bytes -= img->size;
+		dfu_cache_count -= 1;
+		kref_put(&img->ref, dfu_image_free);
+	}
+}
+
+void dfu_cache_insert(u8 *data, size_t size)
+{
+	struct dfu_image *img, *cur;
+	size_t limit;
+
+	limit = dfu_cache_limit();
+	if (size == 0 || size > limit) {
+		kvfree(data);
+		return;
+	}
+	img = kmalloc(sizeof(struct dfu_image), GFP_KERNEL);
+	if (!img) {
+		kvfree(data);
+		return;
+	}
+	sha256(data, size, img->digest);
+	img->data = data;
+	img->size = size;
+	kref_init(&img->ref);
+
+	mutex_lock(&dfu_cache_lock);
+	list_for_each_entry(cur, &dfu_cache, lru) {
+		if (memcmp(cur->digest, img->digest, DFU_DIGEST_SIZE) == 0) {
+			list_move(&cur->lru, &dfu_cache);
+			mutex_unlock(&dfu_cache_lock);
+			kref_put(&img->ref, dfu_image_free);
+			return;
+		}
+	}
+	list_add(&img->lru, &dfu_cache);
+	dfu_cache_bytes += size;
+	dfu_cache_count += 1;
+	dfu_cache_evict(limit);
+	mutex_unlock(&dfu_cache_lock);
+}
+EXPORT_SYMBOL_GPL(dfu_cache_insert);
+
+struct dfu_image *dfu_cache_get(const u8 *digest)
+{
+	struct dfu_image *img;
+
+	mutex_lock(&dfu_cache_lock);
+	list_for_each_entry(img, &dfu_cache, lru) {
+		if (memcmp(img->digest, digest, DFU_DIGEST_SIZE) == 0) {
+			list_move(&img->lru, &dfu_cache);
+			kref_get(&img->ref);
+			dfu_cache_hits += 1;
+			mutex_unlock(&dfu_cache_lock);
+			return img;
+		}
+	}
+	dfu_cache_misses += 1;
+	mutex_unlock(&dfu_cache_lock);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(dfu_cache_get);
+
+void dfu_cache_put(struct dfu_image *img)
+{
+	kref_put(&img->ref, dfu_image_free);
+}
+EXPORT_SYMBOL_GPL(dfu_cache_put);
+
+ssize_t dfu_cache_show(char *buf)
+{
+	struct dfu_image *img;
+	ssize_t len;
+
+	mutex_lock(&dfu_cache_lock);
+	len = sprintf(buf, "Hits: %lu Misses: %lu Images: %d Bytes: %zu/%zu\n",
+			dfu_cache_hits, dfu_cache_misses, dfu_cache_count,
+			dfu_cache_bytes, dfu_cache_limit());
+	list_for_each_entry(img, &dfu_cache, lru) {
+		if (len + 2 * DFU_DIGEST_SIZE + 24 > PAGE_SIZE)
+			break;
+		len += sprintf(buf + len, "%*phN %zu\n", DFU_DIGEST_SIZE,
+				img->digest, img->size);
+	}
+	mutex_unlock(&dfu_cache_lock);
+	return len;
+}
+EXPORT_SYMBOL_GPL(dfu_cache_show);
+
+static int __init dfu_core_init(void)
+{
+	dfu_debugfs = debugfs_create_dir("dfu", NULL);
+	return 0;
+}
+module_init(dfu_core_init);
+
+static void __exit dfu_core_exit(void)
+{
+	debugfs_remove_recursive(dfu_debugfs);
+	mutex_lock(&dfu_cache_lock);
+	dfu_cache_evict(0);
+	mutex_unlock(&dfu_cache_lock);
+}
+module_exit(dfu_core_exit);
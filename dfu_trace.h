@@ -0,0 +1,93 @@
+/*
+ * dfu_trace.h
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * Trace events of the USB DFU transport, created in dfu_core.c
+ *
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dfu
+
+#if !defined(LINUX_USB_DFU_TRACE_DSCAO__) || defined(TRACE_HEADER_MULTI_READ)
+#define LINUX_USB_DFU_TRACE_DSCAO__
+
+#include <linux/tracepoint.h>
+#include "usbdfu.h"
+
+#define show_dfu_request(req) __print_symbolic(req,		\
+		{ USB_DFU_DETACH,	"DETACH" },		\
+		{ USB_DFU_DNLOAD,	"DNLOAD" },		\
+		{ USB_DFU_UPLOAD,	"UPLOAD" },		\
+		{ USB_DFU_GETSTATUS,	"GETSTATUS" },		\
+		{ USB_DFU_CLRSTATUS,	"CLRSTATUS" },		\
+		{ USB_DFU_GETSTATE,	"GETSTATE" },		\
+		{ USB_DFU_ABORT,	"ABORT" })
+
+/*
+ * One control request, from submission to completion. value is the block
+ * number of DNLOAD and UPLOAD.
+ */
+TRACE_EVENT(dfu_urb,
+	TP_PROTO(struct dfu_control *ctrl),
+	TP_ARGS(ctrl),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&ctrl->intf->dev))
+		__field(u8, reqtype)
+		__field(u8, request)
+		__field(u16, value)
+		__field(int, len)
+		__field(int, nxfer)
+		__field(int, status)
+		__field(s64, usecs)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&ctrl->intf->dev));
+		__entry->reqtype = ctrl->req.bRequestType;
+		__entry->request = ctrl->req.bRequest;
+		__entry->value = le16_to_cpu(ctrl->req.wValue);
+		__entry->len = ctrl->len;
+		__entry->nxfer = ctrl->nxfer;
+		__entry->status = ctrl->status;
+		__entry->usecs = ktime_us_delta(ctrl->done, ctrl->start);
+	),
+	TP_printk("%s type=%02x req=%s value=%u len=%d xfer=%d status=%d "
+		"latency=%lldus", __get_str(dev), __entry->reqtype,
+		show_dfu_request(__entry->request), __entry->value,
+		__entry->len, __entry->nxfer, __entry->status, __entry->usecs)
+);
+
+/*
+ * One GETSTATUS answer while waiting for a device to change state. polls
+ * counts the answers of the same wait.
+ */
+TRACE_EVENT(dfu_poll,
+	TP_PROTO(struct usb_interface *intf, struct dfu_status *status,
+		int polls),
+	TP_ARGS(intf, status, polls),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&intf->dev))
+		__field(u8, bstatus)
+		__field(u8, bstate)
+		__field(int, wmsec)
+		__field(int, polls)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&intf->dev));
+		__entry->bstatus = status->bStatus;
+		__entry->bstate = status->bState;
+		__entry->wmsec = wmsec2int(status->wmsec);
+		__entry->polls = polls;
+	),
+	TP_printk("%s state=%u status=%u poll_timeout=%dms polls=%d",
+		__get_str(dev), __entry->bstate, __entry->bstatus,
+		__entry->wmsec, __entry->polls)
+);
+
+#endif /* LINUX_USB_DFU_TRACE_DSCAO__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dfu_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,101 @@
+/*
+ * icdi_trace.h
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * Trace events of the TI USB ICDI driver
+ *
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usb_icdi
+
+#if !defined(LINUX_USB_ICDI_TRACE_DSCAO__) || defined(TRACE_HEADER_MULTI_READ)
+#define LINUX_USB_ICDI_TRACE_DSCAO__
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+#define ICDI_TRACE_HEAD	16
+
+/*
+ * One bulk URB. head holds the start of the packet, '$' for a command,
+ * '+' or '-' for an acknowledged or rejected one.
+ */
+DECLARE_EVENT_CLASS(icdi_urb,
+	TP_PROTO(struct usb_interface *intf, const char *pkt, int len,
+		int nxfer, int status, s64 usecs),
+	TP_ARGS(intf, pkt, len, nxfer, status, usecs),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&intf->dev))
+		__array(char, head, ICDI_TRACE_HEAD)
+		__field(int, len)
+		__field(int, nxfer)
+		__field(int, status)
+		__field(s64, usecs)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&intf->dev));
+		memset(__entry->head, 0, ICDI_TRACE_HEAD);
+		if (status == 0)
+			memcpy(__entry->head, pkt, min_t(int, nxfer,
+						ICDI_TRACE_HEAD - 1));
+		__entry->len = len;
+		__entry->nxfer = nxfer;
+		__entry->status = status;
+		__entry->usecs = usecs;
+	),
+	TP_printk("%s len=%d xfer=%d status=%d latency=%lldus %s",
+		__get_str(dev), __entry->len, __entry->nxfer, __entry->status,
+		__entry->usecs, __entry->head)
+);
+
+DEFINE_EVENT(icdi_urb, icdi_send,
+	TP_PROTO(struct usb_interface *intf, const char *pkt, int len,
+		int nxfer, int status, s64 usecs),
+	TP_ARGS(intf, pkt, len, nxfer, status, usecs)
+);
+
+DEFINE_EVENT(icdi_urb, icdi_recv,
+	TP_PROTO(struct usb_interface *intf, const char *pkt, int len,
+		int nxfer, int status, s64 usecs),
+	TP_ARGS(intf, pkt, len, nxfer, status, usecs)
+);
+
+/*
+ * One command with its reply, resend counts the times the board asked
+ * for the command again.
+ */
+TRACE_EVENT(icdi_sndrcv,
+	TP_PROTO(struct usb_interface *intf, const char *cmd, int inflen,
+		int retv, int resend, s64 usecs),
+	TP_ARGS(intf, cmd, inflen, retv, resend, usecs),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&intf->dev))
+		__array(char, head, ICDI_TRACE_HEAD)
+		__field(int, inflen)
+		__field(int, retv)
+		__field(int, resend)
+		__field(s64, usecs)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&intf->dev));
+		memset(__entry->head, 0, ICDI_TRACE_HEAD);
+		memcpy(__entry->head, cmd, min_t(int, inflen,
+					ICDI_TRACE_HEAD - 1));
+		__entry->inflen = inflen;
+		__entry->retv = retv;
+		__entry->resend = resend;
+		__entry->usecs = usecs;
+	),
+	TP_printk("%s cmd=%s len=%d ret=%d resend=%d time=%lldus",
+		__get_str(dev), __entry->head, __entry->inflen, __entry->retv,
+		__entry->resend, __entry->usecs)
+);
+
+#endif /* LINUX_USB_ICDI_TRACE_DSCAO__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE icdi_trace
+#include <trace/define_trace.h>
@@ -1,5 +1,5 @@
 /*
- * usbdfu.c
+ * usb_dfu.c
  *
  * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
  *
@@ -13,27 +13,23 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/dma-mapping.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/uio.h>
+#include <linux/file.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include "usbdfu.h"
+#include "dfu_trace.h"
 
 #define MODULE_NAME	"subdfu"
-
-#define USB_DFU_DETACH		0
-#define USB_DFU_DNLOAD		1
-#define USB_DFU_UPLOAD		2
-#define USB_DFU_GETSTATUS	3
-#define USB_DFU_CLRSTATUS	4
-#define USB_DFU_GETSTATE	5
-#define USB_DFU_ABORT		6
-
-#define USB_DFU_SUBCLASS	1
-#define USB_DFU_PROTO_RUNTIME	1
-#define USB_DFU_PROTO_DFUMODE	2
-
-#define USB_DFU_FUNC_DSCLEN	9
-#define USB_DFU_FUNC_DSCTYP	0x21
-
-#define USB_DFU_FUNC_DOWN	0x21
-#define USB_DFU_FUNC_UP		0xa1
-#define USB_DFU_ERROR_CODE	255
+#define MAX_DFUS	16
+#define DFU_GROUP_MAX		32
+#define DFU_GROUP_CHUNK		(64*1024)
+#define DFU_GROUP_MAXSIZE	(64ul << 20)
 
 #define CAN_DOWNLOAD	1
 #define CAN_UPLOAD	2
@@ -42,53 +38,44 @@
 
 #define MAX_FMSIZE	(0x7ful << 56)
 
-struct dfufdsc {
-	__u8 len;
-	__u8 dsctyp;
-	__u8 attr;
-	__le16 tmout;
-	__le16 xfersize;
-	__le16 ver;
-} __packed;
-
-struct dfu_status {
-	__u8 bStatus;
-	__u8 wmsec[3];
-	__u8 bState;
-	__u8 istr;
-} __packed;
-
-enum dfu_state {
-	appIDLE = 0,
-	appDETACH = 1,
-	dfuIDLE = 2,
-	dfuDNLOAD_SYNC = 3,
-	dfuDNLOAD_BUSY = 4,
-	dfuDNLOAD_IDLE = 5,
-	dfuMANIFEST_SYNC = 6,
-	dfuMANIFEST = 7,
-	dfuMANIFEST_WAIT_RESET = 8,
-	dfuUPLOAD_IDLE = 9,
-	dfuERROR = 10
+struct dfu_job {
+	struct work_struct work;
+	struct file *image;
+	struct eventfd_ctx *evfd;
+	loff_t offset;
+	u64 total;
+	u64 done;
+	u32 flags;
+	int state;
+	int error;
+	int cancel;
 };
 
 struct dfu_device {
 	struct mutex lock;
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
-	struct usb_ctrlrequest prireq, auxreq;
-	struct completion urbdone;
-	struct urb *urb;
-	int nxfer;
+	struct usb_anchor submitted;
+	struct dfu_control prictrl, auxctrl;
+	struct bin_attribute fmattr;
+	struct dfu_pacer pacer;
+	struct dfu_rto rto;
+	struct dfu_stats stats;
+	struct dfu_job job;
+	u8 *capbuf;		/* image of the sysfs download, for the cache */
+	struct cdev *cdev;
+	struct device *sysdev;
+	dev_t devno;
+	int opened;
+	int gone;
 	int intfnum;
 	int dettmout;
 	int xfersize;
+	int wxfersize;
 	int proto;
 	int dma;
-	volatile int resp;
-	struct dfu_status status;
 	union {
-		unsigned char attrs;
+		unsigned short attrs;
 		struct {
 			unsigned int detach_attr:1;
 			unsigned int capbility_attr:1;
@@ -96,71 +83,18 @@ struct dfu_device {
 			unsigned int firmware_attr:1;
 			unsigned int fmsize_attr:1;
 			unsigned int status_attr:1;
+			unsigned int xfersize_attr:1;
+			unsigned int sweep_attr:1;
+			unsigned int cache_attr:1;
+			unsigned int flash_cached_attr:1;
+			unsigned int urb_timeouts_attr:1;
+			unsigned int refresh_attr:1;
 		};
 	};
 	__u8 cap;
-	__u8 state;
 };
 
-static void dfu_urb_done(struct urb *urb)
-{
-	struct dfu_device *dfudev;
-
-	dfudev = urb->context;
-	dfudev->resp = urb->status;
-	dfudev->nxfer = urb->actual_length;
-	complete(&dfudev->urbdone);
-}
-
-static void dfu_urb_timeout(struct dfu_device *dfudev)
-{
-	usb_unlink_urb(dfudev->urb);
-	wait_for_completion(&dfudev->urbdone);
-}
-
-int dfu_submit_urb(struct dfu_device *dfudev, struct usb_ctrlrequest *req,
-	       	int tmout, void *datbuf, int buflen)
-{
-	int retusb, retv, pipe;
-	unsigned long jiff_wait;
-
-	pipe = -1;
-	if (req->bRequestType == USB_DFU_FUNC_DOWN)
-		pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
-	else if (req->bRequestType == USB_DFU_FUNC_UP)
-		pipe = usb_rcvctrlpipe(dfudev->usbdev, 0);
-	usb_fill_control_urb(dfudev->urb, dfudev->usbdev, pipe,
-			(unsigned char *)req,
-			datbuf, buflen, dfu_urb_done, dfudev);
-	init_completion(&dfudev->urbdone);
-	dfudev->resp = USB_DFU_ERROR_CODE;
-	dfudev->nxfer = 0;
-	retusb = usb_submit_urb(dfudev->urb, GFP_KERNEL);
-	if (retusb != 0) {
-		dev_err(&dfudev->intf->dev,
-			"URB type: %2.2x, req: %2.2x submit failed: %d\n",
-			(int)req->bRequestType, (int)req->bRequest, retusb);
-		return retusb;
-	}
-
-	jiff_wait = msecs_to_jiffies(tmout);
-	if (!wait_for_completion_timeout(&dfudev->urbdone, jiff_wait)) {
-		dfu_urb_timeout(dfudev);
-		dev_err(&dfudev->intf->dev,
-			"URB req type: %2.2x, req: %2.2x timeout\n",
-			(int)req->bRequestType, (int)req->bRequest);
-		return dfudev->resp;
-	}
-	retv = READ_ONCE(dfudev->resp);
-	if (retv)
-		dev_err(&dfudev->intf->dev,
-			"URB type: %2.2x, req: %2.2x request failed: %d\n",
-			(int)req->bRequestType, (int)req->bRequest, retv);
-
-	return retv;
-}
-
-#define DFUDEV_NAME "dfu"
+#define DFUDEV_NAME "sdfu"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Dashi Cao");
@@ -169,8 +103,46 @@ MODULE_DESCRIPTION("USB DFU Driver");
 
 static int urb_timeout = 200; /* milliseconds */
 module_param(urb_timeout, int, 0644);
-MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout. "
-	"Default: 200 milliseconds.");
+MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout until one has "
+	"been learned for the device. Default: 200 milliseconds.");
+
+static int fast_upload = 0;
+module_param(fast_upload, int, 0644);
+MODULE_PARM_DESC(fast_upload, "Upload without a GETSTATUS after each block, "
+	"a short block ends the upload. Default: 0");
+
+static int dnload_retries = 3;
+module_param(dnload_retries, int, 0644);
+MODULE_PARM_DESC(dnload_retries, "Times a failed DNLOAD block is resent "
+	"after recovering the device. Default: 3");
+
+static dev_t dfu_devno;
+static struct class *dfu_class;
+static DEFINE_MUTEX(dfu_minor_lock);
+static struct dfu_device *dfu_minors[MAX_DFUS];
+
+/*
+ * One open session of /dev/sdfuN. Reads and writes of any size are cut
+ * into DFU blocks of xfersize here; blkbuf holds the block in progress.
+ */
+struct dfu_stream {
+	struct dfu_device *dfudev;
+	char *blkbuf;
+	int xfersize;
+	int blknum;
+	int blkpos;
+	int blklen;
+	int mode;
+	int fast;
+	int eof;
+	int error;
+};
+
+#define DFU_STREAM_NONE		0
+#define DFU_STREAM_UPLOAD	1
+#define DFU_STREAM_DNLOAD	2
+#define DFU_STREAM_JOB		3
+#define DFU_STREAM_GROUP	4
 
 static const struct usb_device_id dfu_ids[] = {
 	{	.match_flags = USB_DEVICE_ID_MATCH_VENDOR|
@@ -194,98 +166,283 @@ MODULE_DEVICE_TABLE(usb, dfu_ids);
 
 static inline int dfu_abort(struct dfu_device *dfudev)
 {
-	dfudev->auxreq.bRequestType = USB_DFU_FUNC_DOWN;
-	dfudev->auxreq.bRequest = USB_DFU_ABORT;
-	dfudev->auxreq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->auxreq.wValue = 0;
-	dfudev->auxreq.wLength = 0;
-	return dfu_submit_urb(dfudev, &dfudev->auxreq, urb_timeout, NULL, 0);
+	struct dfu_control *ctrl = &dfudev->auxctrl;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_ABORT, 0, NULL, 0);
+	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
 static inline int dfu_detach(struct dfu_device *dfudev)
 {
-	dfudev->auxreq.bRequestType = USB_DFU_FUNC_DOWN;
-	dfudev->auxreq.bRequest = USB_DFU_DETACH;
-	dfudev->auxreq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->auxreq.wValue = dfudev->dettmout > 5000? 5000 : dfudev->dettmout;
-	dfudev->auxreq.wLength = 0;
-	return dfu_submit_urb(dfudev, &dfudev->auxreq, urb_timeout, NULL, 0);
+	struct dfu_control *ctrl = &dfudev->auxctrl;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_DETACH,
+			dfudev->dettmout > 5000? 5000 : dfudev->dettmout,
+			NULL, 0);
+	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
 static inline int dfu_get_status(struct dfu_device *dfudev)
 {
-	dfudev->auxreq.bRequestType = USB_DFU_FUNC_UP;
-	dfudev->auxreq.bRequest = USB_DFU_GETSTATUS;
-	dfudev->auxreq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->auxreq.wValue = 0;
-	dfudev->auxreq.wLength = cpu_to_le16(6);
-	return dfu_submit_urb(dfudev, &dfudev->auxreq, urb_timeout,
-			&dfudev->status, sizeof(dfudev->status));
+	struct dfu_control *ctrl = &dfudev->auxctrl;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATUS, 0,
+			&ctrl->dfuStatus, sizeof(ctrl->dfuStatus));
+	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
 static inline int dfu_get_state(struct dfu_device *dfudev)
 {
+	struct dfu_control *ctrl = &dfudev->auxctrl;
 	int retv;
 
-	dfudev->auxreq.bRequestType = USB_DFU_FUNC_UP;
-	dfudev->auxreq.bRequest = USB_DFU_GETSTATE;
-	dfudev->auxreq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->auxreq.wValue = 0;
-	dfudev->auxreq.wLength = cpu_to_le16(1);
-	retv = dfu_submit_urb(dfudev, &dfudev->auxreq, urb_timeout,
-			&dfudev->state, sizeof(dfudev->state));
+	dfu_fill_control(ctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATE, 0,
+			&ctrl->dfuState, sizeof(ctrl->dfuState));
+	retv = dfu_submit_urb(ctrl, urb_timeout);
 	if (retv == 0)
-		retv = dfudev->state;
+		retv = ctrl->dfuState;
 	return retv;
 }
 
 static inline int dfu_clear_status(struct dfu_device *dfudev)
 {
-	dfudev->auxreq.bRequestType = USB_DFU_FUNC_DOWN;
-	dfudev->auxreq.bRequest = USB_DFU_CLRSTATUS;
-	dfudev->auxreq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->auxreq.wValue = 0;
-	dfudev->auxreq.wLength = 0;
-	return dfu_submit_urb(dfudev, &dfudev->auxreq, urb_timeout, NULL, 0);
+	struct dfu_control *ctrl = &dfudev->auxctrl;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_CLRSTATUS, 0,
+			NULL, 0);
+	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
 static inline int dfu_finish_dnload(struct dfu_device *dfudev)
 {
-	dfudev->prireq.bRequestType = USB_DFU_FUNC_DOWN;
-	dfudev->prireq.bRequest = USB_DFU_DNLOAD;
-	dfudev->prireq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->prireq.wValue = 0;
-	dfudev->prireq.wLength = 0;
-	return dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout, NULL, 0);
+	struct dfu_control *ctrl = &dfudev->prictrl;
+
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_DNLOAD, 0, NULL, 0);
+	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
-static inline int wmsec2int(unsigned char *wmsec)
+/*
+ * Send one UPLOAD or DNLOAD block with a GETSTATUS chained behind it. The
+ * status lands in auxctrl.dfuStatus, the transferred length in
+ * prictrl.nxfer.
+ */
+static int dfu_xfer_block(struct dfu_device *dfudev, int request, int blknum,
+		void *buf, int len)
 {
-	return (wmsec[2] << 16)|(wmsec[1] << 8) | wmsec[0];
+	struct dfu_control *prictrl = &dfudev->prictrl;
+	struct dfu_control *auxctrl = &dfudev->auxctrl;
+	int retv;
+
+	dfu_fill_control(prictrl, request == USB_DFU_UPLOAD?
+			USB_DFU_FUNC_UP : USB_DFU_FUNC_DOWN, request, blknum,
+			buf, len);
+	dfu_fill_control(auxctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATUS, 0,
+			&auxctrl->dfuStatus, sizeof(auxctrl->dfuStatus));
+	prictrl->next = auxctrl;
+	prictrl->complete = NULL;
+	auxctrl->next = NULL;
+	auxctrl->complete = NULL;
+	retv = dfu_submit_async(prictrl, &dfudev->submitted, GFP_KERNEL);
+	if (retv == 0)
+		retv = dfu_wait_urb(prictrl, urb_timeout);
+	prictrl->next = NULL;
+	return retv;
 }
 
-static int dfu_wait_state(struct dfu_device *dfudev, int state_mask)
+/*
+ * Poll with GETSTATUS, starting from the status already held in auxctrl,
+ * until the device reaches one of the states in state_mask.
+ */
+static int dfu_poll_state(struct dfu_device *dfudev, int state_mask)
 {
-	int count = 0, usb_resp, mwait;
+	struct dfu_status *status = &dfudev->auxctrl.dfuStatus;
+	int usb_resp;
+	ktime_t next;
 
 	state_mask |= (1<<dfuERROR);
-	do {
+	if (state_mask & (1 << status->bState))
+		return status->bState;
+	next = dfu_pace_begin(&dfudev->pacer, wmsec2int(status->wmsec),
+			status->bState == dfuDNLOAD_BUSY);
+	for (;;) {
+		if (dfu_pace_expired(&dfudev->pacer)) {
+			dev_err(&dfudev->intf->dev, "DFU Stalled\n");
+			return status->bState;
+		}
+		dfu_pace_sleep(next);
 		usb_resp = dfu_get_status(dfudev);
 		if (usb_resp) {
 			dev_err(&dfudev->intf->dev, "Cannot get DFU status: " \
 					"%d\n", usb_resp);
 			return usb_resp;
 		}
-		if (state_mask & (1 << dfudev->status.bState))
+		trace_dfu_poll(dfudev->intf, status, dfudev->pacer.polls + 1);
+		if (state_mask & (1 << status->bState))
 			break;
-		mwait = wmsec2int(dfudev->status.wmsec);
-		msleep(mwait);
-		count += 1;
-	} while (count < 5);
-	if (count == 5)
-		dev_err(&dfudev->intf->dev, "DFU Stalled\n");
-	return dfudev->status.bState;
+		next = dfu_pace_next(&dfudev->pacer,
+				wmsec2int(status->wmsec));
+	}
+	dfu_pace_end(&dfudev->pacer);
+	return status->bState;
+}
+
+static int dfu_wait_state(struct dfu_device *dfudev, int state_mask)
+{
+	int usb_resp;
+
+	usb_resp = dfu_get_status(dfudev);
+	if (usb_resp) {
+		dev_err(&dfudev->intf->dev, "Cannot get DFU status: %d\n",
+				usb_resp);
+		return usb_resp;
+	}
+	trace_dfu_poll(dfudev->intf, &dfudev->auxctrl.dfuStatus, 0);
+	return dfu_poll_state(dfudev, state_mask);
+}
+
+/*
+ * Fetch one UPLOAD block. Unless fast is set, a GETSTATUS follows it and
+ * the device is polled until it settles in dfuUPLOAD_IDLE or dfuIDLE.
+ * In fast mode nothing but the UPLOAD goes on the wire: a block shorter
+ * than asked for ends the upload and leaves the device in dfuIDLE.
+ * Returns the new DFU state or a negative error, prictrl.status tells
+ * whether the block itself was lost.
+ */
+static int dfu_upload_block(struct dfu_device *dfudev, int blknum,
+		void *buf, int len, int fast)
+{
+	struct dfu_control *prictrl = &dfudev->prictrl;
+	int retv;
+
+	if (!fast) {
+		retv = dfu_xfer_block(dfudev, USB_DFU_UPLOAD, blknum, buf, len);
+		if (retv)
+			return retv;
+		return dfu_poll_state(dfudev, (1<<dfuUPLOAD_IDLE|1<<dfuIDLE));
+	}
+	dfu_fill_control(prictrl, USB_DFU_FUNC_UP, USB_DFU_UPLOAD, blknum,
+			buf, len);
+	prictrl->next = NULL;
+	prictrl->complete = NULL;
+	retv = dfu_submit_async(prictrl, &dfudev->submitted, GFP_KERNEL);
+	if (retv == 0)
+		retv = dfu_wait_urb(prictrl, urb_timeout);
+	if (retv)
+		return retv;
+	return prictrl->nxfer < len? dfuIDLE : dfuUPLOAD_IDLE;
+}
+
+/*
+ * Bring the device back after a failed DNLOAD. Returns 1 if the device
+ * turns out to have taken the block, 0 if it is ready to get the block
+ * again, or an error. A device in dfuERROR is cleared back to dfuIDLE;
+ * the block is then resent with its original number, which is where a
+ * device that places data by wBlockNum picks up again.
+ */
+static int dfu_dnload_recover(struct dfu_device *dfudev, int received)
+{
+	struct dfu_status *status = &dfudev->auxctrl.dfuStatus;
+	int dfu_state;
+
+	if (dfu_get_status(dfudev))
+		return 0;
+	if (status->bState == dfuDNLOAD_SYNC ||
+			status->bState == dfuDNLOAD_BUSY)
+		received = 1;
+	dfu_state = dfu_poll_state(dfudev, 1 << dfuDNLOAD_IDLE | 1 << dfuIDLE);
+	if (dfu_state == dfuERROR) {
+		dev_warn(&dfudev->intf->dev, "Clearing DFU Status: %d\n",
+				status->bStatus);
+		if (dfu_clear_status(dfudev))
+			return -EIO;
+		return 0;
+	}
+	if (dfu_state == dfuDNLOAD_IDLE)
+		return received;
+	if (dfu_state == dfuIDLE)
+		return 0;
+	return dfu_state < 0? dfu_state : -EPROTO;
+}
+
+/*
+ * Send one DNLOAD block and wait for the device to take it. Everything
+ * before blknum has been acknowledged; if this block fails it is resent
+ * after dfu_dnload_recover(), up to dnload_retries times.
+ */
+static int dfu_dnload_block(struct dfu_device *dfudev, int blknum,
+		void *buf, int len)
+{
+	int retry, retv, received;
+
+	for (retry = 0; ; retry++) {
+		retv = dfu_xfer_block(dfudev, USB_DFU_DNLOAD, blknum, buf, len);
+		received = dfudev->prictrl.status == 0 &&
+			dfudev->prictrl.nxfer == len;
+		if (retv == 0) {
+			retv = dfu_poll_state(dfudev, 1 << dfuDNLOAD_IDLE);
+			if (retv == dfuDNLOAD_IDLE)
+				return 0;
+			if (retv >= 0) {
+				dev_err(&dfudev->intf->dev, "Cannot continue " \
+					"downloading. Invalid state: %d\n",
+					retv);
+				retv = -EPROTO;
+			}
+		}
+		if (retry >= READ_ONCE(dnload_retries)) {
+			dev_err(&dfudev->intf->dev, "DFU download error: %d\n",
+					retv);
+			return retv;
+		}
+		dev_warn(&dfudev->intf->dev, "Block %d failed: %d, retrying\n",
+				blknum, retv);
+		retv = dfu_dnload_recover(dfudev, received);
+		if (retv < 0)
+			return retv;
+		if (retv == 1)
+			return 0;
+	}
+}
+
+/*
+ * End a download with the zero length DNLOAD and see the device through
+ * manifestation.
+ */
+static int dfu_manifest(struct dfu_device *dfudev, int blknum, int reset)
+{
+	int usb_resp, dfu_state, state_mask;
+
+	usb_resp = dfu_xfer_block(dfudev, USB_DFU_DNLOAD, blknum, NULL, 0);
+	if (usb_resp) {
+		dev_err(&dfudev->intf->dev, "DFU download error: %d\n",
+				usb_resp);
+		return usb_resp;
+	}
+	state_mask = (1<<dfuIDLE)|(1<<dfuMANIFEST)|
+		(1<<dfuMANIFEST_WAIT_RESET);
+	dfu_state = dfu_poll_state(dfudev, state_mask);
+	if (dfu_state == dfuIDLE)
+		return 0;
+	msleep(wmsec2int(dfudev->auxctrl.dfuStatus.wmsec)+1);
+	dfu_state = dfu_wait_state(dfudev, state_mask);
+	if (dfu_state == dfuIDLE)
+		return 0;
+	if (dfu_state == dfuMANIFEST_WAIT_RESET) {
+		if (reset)
+			usb_queue_reset_device(dfudev->intf);
+		return 0;
+	}
+	if (dfu_state == dfuERROR) {
+		dfu_clear_status(dfudev);
+		dev_warn(&dfudev->intf->dev, "State changed to " \
+				"dfuERROR. Error cleared\n");
+		return -EIO;
+	} else
+		dev_warn(&dfudev->intf->dev, "Unexpected State after" \
+			       " firmware downloading\n");
+	return 0;
 }
+
 static ssize_t abort_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
@@ -377,31 +534,45 @@ static ssize_t capbility_show(struct device *dev,
 			download, upload, manifest, detach);
 }
 
+/*
+ * Served from the snapshot kept by the I/O path, so reading it neither
+ * waits behind a transfer nor puts a request on ep0. Age is how long
+ * ago, in ms, the state was last seen; write to refresh for a live one.
+ */
 static ssize_t status_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct dfu_device *dfudev;
 	struct usb_interface *interface;
-	int resp, mwait, retv;
+	struct dfu_snapval snap;
+	s64 age;
+
+	interface = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(interface);
+	dfu_snap_read(&dfudev->stats, &snap);
+	age = snap.when? ktime_ms_delta(ktime_get(), snap.when) : -1;
+	return sprintf(buf, "Status: %d State: %d Wait: %d Done: %llu " \
+			"Age: %lld\n", snap.bstatus, snap.bstate, snap.wmsec,
+			snap.done, age);
+}
+
+static ssize_t refresh_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *interface;
+	int resp;
 
 	interface = container_of(dev, struct usb_interface, dev);
 	dfudev = usb_get_intfdata(interface);
 	mutex_lock(&dfudev->lock);
 	resp = dfu_get_status(dfudev);
 	mutex_unlock(&dfudev->lock);
-	if (resp == 0) {
-		mwait = dfudev->status.wmsec[2]<<16|
-			dfudev->status.wmsec[1]<<8|
-			dfudev->status.wmsec[0];
-		retv = sprintf(buf, "Status: %hhd State: %hhd Wait: %d\n",
-				dfudev->status.bStatus,
-				dfudev->status.bState,
-				mwait);
-	} else {
+	if (resp) {
 		dev_err(dev, "Get DFU Status failed: %d\n", resp);
-		retv = 0;
+		return resp;
 	}
-	return retv;
+	return count;
 }
 
 ssize_t firmware_read(struct file *filep, struct kobject *kobj,
@@ -415,7 +586,7 @@ static DEVICE_ATTR_WO(detach);
 static DEVICE_ATTR_WO(abort);
 static DEVICE_ATTR_RO(capbility);
 static DEVICE_ATTR_RO(status);
-static BIN_ATTR_RW(firmware, 0);
+static DEVICE_ATTR_WO(refresh);
 
 ssize_t firmware_read(struct file *filep, struct kobject *kobj,
 		struct bin_attribute *binattr, 
@@ -424,7 +595,7 @@ ssize_t firmware_read(struct file *filep, struct kobject *kobj,
 	struct device *dev;
 	struct usb_interface *intf;
 	struct dfu_device *dfudev;
-	int pos, usb_resp, remlen, dfu_state, blknum, state_mask;
+	int pos, remlen, dfu_state, blknum, fast;
 	unsigned long fm_size;
 	char *curbuf;
 
@@ -450,10 +621,6 @@ ssize_t firmware_read(struct file *filep, struct kobject *kobj,
 	pos = 0;
 	curbuf = buf;
 	remlen = offset + bufsz <= fm_size? bufsz : fm_size - offset;
-	dfudev->prireq.bRequestType = USB_DFU_FUNC_UP;
-	dfudev->prireq.bRequest = USB_DFU_UPLOAD;
-	dfudev->prireq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->prireq.wLength = cpu_to_le16(dfudev->xfersize);
 	blknum = offset / dfudev->xfersize;
 
 	mutex_lock(&dfudev->lock);
@@ -469,26 +636,24 @@ ssize_t firmware_read(struct file *filep, struct kobject *kobj,
 		goto exit_10;
 	}
 	dfu_state = dfuUPLOAD_IDLE;
-	state_mask = (1<<dfuUPLOAD_IDLE|1<<dfuIDLE);
+	fast = READ_ONCE(fast_upload);
 	while (remlen > dfudev->xfersize && offset + pos < fm_size &&
 			dfu_state == dfuUPLOAD_IDLE) {
-		dfudev->prireq.wValue = cpu_to_le16(blknum);
-		usb_resp = dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout,
-				curbuf, dfudev->xfersize);
-		if (usb_resp) {
-			dev_err(dev, "DFU upload error: %d\n", usb_resp);
-			pos = usb_resp;
+		dfu_state = dfu_upload_block(dfudev, blknum, curbuf,
+				dfudev->xfersize, fast);
+		if (dfu_state < 0 && dfudev->prictrl.status) {
+			dev_err(dev, "DFU upload error: %d\n", dfu_state);
+			pos = dfu_state;
 			goto exit_10;
 		}
-		WARN_ON(dfudev->nxfer == 0);
-		pos += dfudev->nxfer;
-		curbuf += dfudev->nxfer;
-		remlen -= dfudev->nxfer;
+		WARN_ON(!fast && dfudev->prictrl.nxfer == 0);
+		pos += dfudev->prictrl.nxfer;
+		curbuf += dfudev->prictrl.nxfer;
+		remlen -= dfudev->prictrl.nxfer;
 		blknum += 1;
-		dfu_state = dfu_wait_state(dfudev, state_mask);
 	}
 	if (dfu_state == dfuIDLE) {
-		bin_attr_firmware.size = offset + pos;
+		binattr->size = offset + pos;
 		goto exit_10;
 	}
 	if (unlikely(dfu_state != dfuUPLOAD_IDLE)) {
@@ -501,22 +666,18 @@ ssize_t firmware_read(struct file *filep, struct kobject *kobj,
 		goto exit_10;
 	}
 	BUG_ON(remlen == 0);
-	dfudev->prireq.wValue = cpu_to_le16(blknum);
-	dfudev->prireq.wLength = cpu_to_le16(remlen);
-	usb_resp = dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout,
-			curbuf, remlen);
-	if (usb_resp) {
-		dev_err(dev, "DFU upload error: %d\n", usb_resp);
-		pos = usb_resp;
+	dfu_state = dfu_upload_block(dfudev, blknum, curbuf, remlen, fast);
+	if (dfu_state < 0 && dfudev->prictrl.status) {
+		dev_err(dev, "DFU upload error: %d\n", dfu_state);
+		pos = dfu_state;
 		goto exit_10;
 	}
-	WARN_ON(dfudev->nxfer == 0);
-	pos += dfudev->nxfer;
-	dfu_state = dfu_wait_state(dfudev, state_mask);
+	WARN_ON(!fast && dfudev->prictrl.nxfer == 0);
+	pos += dfudev->prictrl.nxfer;
 	if (offset + pos == fm_size && dfu_state == dfuUPLOAD_IDLE)
 			dfu_abort(dfudev);
 	if (dfu_state == dfuIDLE)
-		bin_attr_firmware.size = offset + pos;
+		binattr->size = offset + pos;
 
 exit_10:
 	mutex_unlock(&dfudev->lock);
@@ -530,7 +691,7 @@ ssize_t firmware_write(struct file *filep, struct kobject *kobj,
 	struct device *dev;
 	struct usb_interface *intf;
 	struct dfu_device *dfudev;
-	int dfu_state, pos, usb_resp, remlen, blknum, state_mask;
+	int dfu_state, pos, usb_resp, remlen, blknum, manifested;
 	unsigned long fm_size;
 	char *curbuf;
 
@@ -558,10 +719,6 @@ ssize_t firmware_write(struct file *filep, struct kobject *kobj,
 	pos = 0;
 	remlen = offset + bufsize <= fm_size? bufsize : fm_size - offset;
 	curbuf = buf;
-	dfudev->prireq.bRequestType = USB_DFU_FUNC_DOWN;
-	dfudev->prireq.bRequest = USB_DFU_DNLOAD;
-	dfudev->prireq.wIndex = cpu_to_le16(dfudev->intfnum);
-	dfudev->prireq.wLength = cpu_to_le16(dfudev->xfersize);
 	blknum = offset / dfudev->xfersize;
 	mutex_lock(&dfudev->lock);
 	dfu_state = dfu_get_state(dfudev);
@@ -572,192 +729,1269 @@ ssize_t firmware_write(struct file *filep, struct kobject *kobj,
 		pos = -EPROTO;
 		goto exit_10;
 	}
-	dfu_state = dfuDNLOAD_IDLE;
-	state_mask = (1 << dfuDNLOAD_IDLE);
-	while (remlen > dfudev->xfersize && offset + pos < fm_size &&
-			dfu_state == dfuDNLOAD_IDLE) {
-		dfudev->prireq.wValue = cpu_to_le16(blknum);
-		usb_resp = dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout,
-				curbuf, dfudev->xfersize);
+	if (offset == 0) {
+		dfu_stats_begin(&dfudev->stats);
+		kvfree(dfudev->capbuf);
+		dfudev->capbuf = NULL;
+		if (fm_size <= dfu_cache_limit())
+			dfudev->capbuf = kvmalloc(fm_size, GFP_KERNEL);
+	}
+	manifested = 0;
+	while (remlen > dfudev->xfersize && offset + pos < fm_size) {
+		usb_resp = dfu_dnload_block(dfudev, blknum, curbuf,
+				dfudev->xfersize);
 		if (usb_resp) {
-			dev_err(dev, "DFU download error: %d\n", usb_resp);
-			pos = usb_resp;
+			pos = pos? pos : usb_resp;
 			goto exit_10;
 		}
-		WARN_ON(dfudev->nxfer == 0);
-		pos += dfudev->nxfer;
-		curbuf += dfudev->nxfer;
-		remlen -= dfudev->nxfer;
+		pos += dfudev->xfersize;
+		curbuf += dfudev->xfersize;
+		remlen -= dfudev->xfersize;
 		blknum += 1;
-		dfu_state = dfu_wait_state(dfudev, state_mask);
-	}
-	if (unlikely(dfu_state != dfuDNLOAD_IDLE)) {
-		dev_err(&dfudev->intf->dev, "Cannot continue downloading. " \
-				"Invalid state: %d\n", dfu_state);
-		goto exit_10;
 	}
 	if (offset + pos < fm_size) {
 		BUG_ON(remlen == 0);
-		dfudev->prireq.wValue = cpu_to_le16(blknum);
-		dfudev->prireq.wLength = cpu_to_le16(remlen);
-		usb_resp = dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout,
-				curbuf, remlen);
+		usb_resp = dfu_dnload_block(dfudev, blknum, curbuf, remlen);
 		if (usb_resp) {
-			dev_err(dev, "DFU download error: %d\n", usb_resp);
-			pos = usb_resp;
+			pos = pos? pos : usb_resp;
 			goto exit_10;
 		}
-		WARN_ON(dfudev->nxfer == 0);
-		pos += dfudev->nxfer;
-		dfu_state = dfu_wait_state(dfudev, state_mask);
+		pos += remlen;
 	}
 	if (offset + pos == fm_size) {
-		dfudev->prireq.wValue = cpu_to_le16(blknum+1);
-		dfudev->prireq.wLength = 0;
-		usb_resp = dfu_submit_urb(dfudev, &dfudev->prireq, urb_timeout,
-				NULL, 0);
-		if (usb_resp) {
-			dev_err(dev, "DFU download error: %d\n", usb_resp);
+		usb_resp = dfu_manifest(dfudev, blknum+1, 1);
+		if (usb_resp)
 			pos = usb_resp;
-			goto exit_10;
-		}
-		state_mask = (1<<dfuIDLE)|(1<<dfuMANIFEST)|
-			(1<<dfuMANIFEST_WAIT_RESET);
-		dfu_state = dfu_wait_state(dfudev, state_mask);
-		if (dfu_state == dfuIDLE)
-			goto exit_10;
-		msleep(wmsec2int(dfudev->status.wmsec)+1);
-		dfu_state = dfu_wait_state(dfudev, state_mask);
-		if (dfu_state == dfuIDLE)
-			goto exit_10;
-		if (dfu_state == dfuMANIFEST_WAIT_RESET) {
-			usb_reset_device(dfudev->usbdev);
-			goto exit_10;
-		}
-		if (dfu_state == dfuERROR) {
-			dfu_clear_status(dfudev);
-			dev_warn(&dfudev->intf->dev, "State changed to " \
-					"dfuERROR. Error cleared\n");
-		} else
-			dev_warn(&dfudev->intf->dev, "Unexpected State after" \
-				       " firmware downloading\n");
+		else
+			manifested = 1;
 	}
 
 exit_10:
+	if (pos <= 0 || offset + pos == fm_size)
+		dfu_stats_end(&dfudev->stats);
+	if (dfudev->capbuf) {
+		if (pos > 0)
+			memcpy(dfudev->capbuf + offset, buf, pos);
+		if (pos > 0 && manifested)
+			dfu_cache_insert(dfudev->capbuf, fm_size);
+		else if (pos <= 0 || offset + pos == fm_size)
+			kvfree(dfudev->capbuf);
+		if (pos <= 0 || offset + pos == fm_size)
+			dfudev->capbuf = NULL;
+	}
 	mutex_unlock(&dfudev->lock);
 	return pos;
 }
 
-static ssize_t fmsize_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
-{
-	return sprintf(buf, "%lu", bin_attr_firmware.size);
-}
-
-static ssize_t fmsize_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t buflen)
+static int dfu_stream_open(struct inode *inode, struct file *filp)
 {
-	char *tmpbuf, *endchr;
+	struct dfu_device *dfudev;
+	struct dfu_stream *stream;
+	int retv;
 
-	tmpbuf = kmalloc(buflen+1, GFP_KERNEL);
-	if (!tmpbuf) {
-		dev_err(dev, "Out of Memory\n");
-		return -ENOMEM;
+	retv = 0;
+	mutex_lock(&dfu_minor_lock);
+	dfudev = dfu_minors[iminor(inode)];
+	if (!dfudev) {
+		mutex_unlock(&dfu_minor_lock);
+		return -ENODEV;
 	}
-	memcpy(tmpbuf, buf, buflen);
-	tmpbuf[buflen] = 0;
-	bin_attr_firmware.size = simple_strtoul(tmpbuf, &endchr, 10);
-	kfree(tmpbuf);
-	return buflen;
+	mutex_lock(&dfudev->lock);
+	mutex_unlock(&dfu_minor_lock);
+	if (dfudev->opened) {
+		retv = -EBUSY;
+		goto exit_10;
+	}
+	stream = kzalloc(sizeof(struct dfu_stream), GFP_KERNEL);
+	if (!stream) {
+		retv = -ENOMEM;
+		goto exit_10;
+	}
+	stream->xfersize = dfudev->xfersize;
+	stream->blkbuf = kmalloc(stream->xfersize, GFP_KERNEL);
+	if (!stream->blkbuf) {
+		kfree(stream);
+		retv = -ENOMEM;
+		goto exit_10;
+	}
+	stream->dfudev = dfudev;
+	stream->mode = DFU_STREAM_NONE;
+	dfudev->opened = 1;
+	filp->private_data = stream;
+
+exit_10:
+	mutex_unlock(&dfudev->lock);
+	return retv;
 }
 
-static DEVICE_ATTR_RW(fmsize);
+/*
+ * Send the block collected in blkbuf as one DNLOAD and wait for the device
+ * to take it.
+ */
+static int dfu_stream_flush(struct dfu_stream *stream)
+{
+	struct dfu_device *dfudev = stream->dfudev;
+	int usb_resp;
+
+	usb_resp = dfu_dnload_block(dfudev, stream->blknum, stream->blkbuf,
+			stream->blklen);
+	if (usb_resp)
+		return usb_resp;
+	stream->blknum += 1;
+	stream->blklen = 0;
+	return 0;
+}
 
-static int dfu_create_attrs(struct dfu_device *dfudev)
+static int dfu_stream_release(struct inode *inode, struct file *filp)
 {
-	int retv;
+	struct dfu_stream *stream;
+	struct dfu_device *dfudev;
+	int dfu_state, gone;
 
-	dfudev->attrs = 0;
-	if (dfudev->proto == USB_DFU_PROTO_RUNTIME) {
-		retv = device_create_file(&dfudev->intf->dev, &dev_attr_detach);
-		if (unlikely(retv != 0))
-			dev_warn(&dfudev->intf->dev,
-					"Cannot create sysfs file %d\n", retv);
-		else
-			dfudev->detach_attr = 1;
-	} else {
-		retv = device_create_file(&dfudev->intf->dev, &dev_attr_status);
-		if (unlikely(retv != 0))
-			dev_warn(&dfudev->intf->dev,
-					"Cannot create sysfs file %d\n", retv);
-		else
-			dfudev->status_attr = 1;
-		retv = device_create_file(&dfudev->intf->dev, &dev_attr_fmsize);
-		if (unlikely(retv != 0))
-			dev_warn(&dfudev->intf->dev,
-					"Cannot create sysfs file %d\n", retv);
-		else
-			dfudev->fmsize_attr = 1;
-		retv = device_create_file(&dfudev->intf->dev, &dev_attr_abort);
-		if (unlikely(retv != 0))
-			dev_warn(&dfudev->intf->dev,
-					"Cannot create sysfs file %d\n", retv);
-		else
-			dfudev->abort_attr = 1;
-		retv = sysfs_create_bin_file(&dfudev->intf->dev.kobj,
-				&bin_attr_firmware);
-		if (unlikely(retv != 0))
-			dev_warn(&dfudev->intf->dev,
-					"Cannot create sysfs file %d\n", retv);
-		else
-			dfudev->firmware_attr = 1;
+	stream = filp->private_data;
+	dfudev = stream->dfudev;
+	if (stream->mode == DFU_STREAM_JOB) {
+		WRITE_ONCE(dfudev->job.cancel, 1);
+		flush_work(&dfudev->job.work);
 	}
-	retv = device_create_file(&dfudev->intf->dev, &dev_attr_capbility);
-	if (unlikely(retv != 0))
-		dev_warn(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-	else
-		dfudev->capbility_attr = 1;
-	return retv;
+	mutex_lock(&dfudev->lock);
+	if (dfudev->gone || stream->mode == DFU_STREAM_NONE ||
+			stream->mode == DFU_STREAM_JOB)
+		goto exit_10;
+	if (stream->mode == DFU_STREAM_DNLOAD && !stream->error) {
+		if (stream->blklen > 0)
+			stream->error = dfu_stream_flush(stream);
+		if (!stream->error)
+			stream->error = dfu_manifest(dfudev, stream->blknum, 1);
+		if (!stream->error)
+			goto exit_10;
+	}
+	dfu_state = dfu_get_state(dfudev);
+	if (dfu_state == dfuERROR)
+		dfu_clear_status(dfudev);
+	else if (dfu_state == dfuUPLOAD_IDLE || dfu_state == dfuDNLOAD_IDLE)
+		dfu_abort(dfudev);
+
+exit_10:
+	if (!dfudev->gone && (stream->mode == DFU_STREAM_UPLOAD ||
+				stream->mode == DFU_STREAM_DNLOAD))
+		dfu_stats_end(&dfudev->stats);
+	dfudev->opened = 0;
+	gone = dfudev->gone;
+	mutex_unlock(&dfudev->lock);
+	if (gone)
+		kfree(dfudev);
+	kfree(stream->blkbuf);
+	kfree(stream);
+	filp->private_data = NULL;
+	return 0;
 }
 
-static void dfu_remove_attrs(struct dfu_device *dfudev)
+/*
+ * Begin an upload or download on the first read or write of the session.
+ * Called with dfudev->lock held.
+ */
+static int dfu_stream_start(struct dfu_stream *stream, int mode, int cap)
 {
-	if (dfudev->detach_attr)
-		device_remove_file(&dfudev->intf->dev, &dev_attr_detach);
-	if (dfudev->firmware_attr)
-		sysfs_remove_bin_file(&dfudev->intf->dev.kobj, &bin_attr_firmware);
-	if (dfudev->abort_attr)
-		device_remove_file(&dfudev->intf->dev, &dev_attr_abort);
-	if (dfudev->fmsize_attr)
-		device_remove_file(&dfudev->intf->dev, &dev_attr_fmsize);
-	if (dfudev->status_attr)
-		device_remove_file(&dfudev->intf->dev, &dev_attr_status);
-	if (dfudev->capbility_attr)
-		device_remove_file(&dfudev->intf->dev, &dev_attr_capbility);
+	struct dfu_device *dfudev = stream->dfudev;
+	int dfu_state;
+
+	if (dfudev->gone)
+		return -ENODEV;
+	if (stream->error)
+		return stream->error;
+	if (stream->mode == mode)
+		return 0;
+	if (stream->mode != DFU_STREAM_NONE)
+		return -EBUSY;
+	if ((dfudev->cap & cap) == 0)
+		return -EOPNOTSUPP;
+	dfu_state = dfu_get_state(dfudev);
+	if (dfu_state != dfuIDLE) {
+		dev_err(&dfudev->intf->dev, "Incompatible State: %d\n",
+				dfu_state);
+		return -EPROTO;
+	}
+	stream->mode = mode;
+	stream->fast = READ_ONCE(fast_upload);
+	dfu_stats_begin(&dfudev->stats);
+	return 0;
 }
 
-static int dfu_probe(struct usb_interface *intf,
-			const struct usb_device_id *id)
+static ssize_t dfu_stream_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int retv, dfufdsc_len, resp;
+	struct dfu_stream *stream;
 	struct dfu_device *dfudev;
-	struct dfufdsc *dfufdsc;
+	int dfu_state, len, retv;
+	size_t numb, copied;
 
-	retv = 0;
-	dfufdsc = (struct dfufdsc *)intf->cur_altsetting->extra;
-	dfufdsc_len = intf->cur_altsetting->extralen;
-	if (!dfufdsc || dfufdsc_len != USB_DFU_FUNC_DSCLEN ||
-			dfufdsc->dsctyp != USB_DFU_FUNC_DSCTYP) {
-		dev_err(&intf->dev, "Invalid DFU functional descriptor\n");
-		return -ENODEV;
+	stream = iocb->ki_filp->private_data;
+	dfudev = stream->dfudev;
+	numb = 0;
+	mutex_lock(&dfudev->lock);
+	retv = dfu_stream_start(stream, DFU_STREAM_UPLOAD, CAN_UPLOAD);
+	while (retv == 0 && iov_iter_count(to) > 0) {
+		if (stream->blkpos < stream->blklen) {
+			len = stream->blklen - stream->blkpos;
+			if (len > iov_iter_count(to))
+				len = iov_iter_count(to);
+			copied = copy_to_iter(stream->blkbuf + stream->blkpos,
+					len, to);
+			stream->blkpos += copied;
+			numb += copied;
+			if (copied != len)
+				retv = -EFAULT;
+			continue;
+		}
+		if (stream->eof)
+			break;
+		dfu_state = dfu_upload_block(dfudev, stream->blknum,
+				stream->blkbuf, stream->xfersize, stream->fast);
+		if (dfu_state < 0 && dfudev->prictrl.status) {
+			dev_err(&dfudev->intf->dev, "DFU upload error: %d\n",
+					dfu_state);
+			stream->error = retv = dfu_state;
+			break;
+		}
+		stream->blknum += 1;
+		stream->blkpos = 0;
+		stream->blklen = dfudev->prictrl.nxfer;
+		if (dfu_state != dfuUPLOAD_IDLE) {
+			stream->eof = 1;
+			if (dfu_state != dfuIDLE)
+				dev_err(&dfudev->intf->dev, "Cannot continue " \
+					"uploading, inconsistent state: %d\n",
+					dfu_state);
+		}
+	}
+	mutex_unlock(&dfudev->lock);
+	iocb->ki_pos += numb;
+	return numb? numb : retv;
+}
+
+static ssize_t dfu_stream_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dfu_stream *stream;
+	struct dfu_device *dfudev;
+	int len, retv, failed;
+	size_t numb;
+
+	stream = iocb->ki_filp->private_data;
+	dfudev = stream->dfudev;
+	numb = 0;
+	failed = 0;
+	mutex_lock(&dfudev->lock);
+	retv = dfu_stream_start(stream, DFU_STREAM_DNLOAD, CAN_DOWNLOAD);
+	while (retv == 0 && iov_iter_count(from) > 0) {
+		len = stream->xfersize - stream->blklen;
+		if (len > iov_iter_count(from))
+			len = iov_iter_count(from);
+		if (copy_from_iter(stream->blkbuf + stream->blklen, len,
+					from) != len) {
+			retv = -EFAULT;
+			break;
+		}
+		stream->blklen += len;
+		numb += len;
+		if (stream->blklen == stream->xfersize) {
+			retv = dfu_stream_flush(stream);
+			stream->error = retv;
+			failed = retv != 0;
+		}
+	}
+	mutex_unlock(&dfudev->lock);
+	iocb->ki_pos += numb;
+	if (failed)
+		return retv;
+	return numb? numb : retv;
+}
+
+/*
+ * Send the last partial block and manifest, so that a download can be
+ * checked for success before close(). The next write starts a new one.
+ */
+static int dfu_stream_fsync(struct file *filp, loff_t start, loff_t end,
+		int datasync)
+{
+	struct dfu_stream *stream;
+	struct dfu_device *dfudev;
+	int retv;
+
+	stream = filp->private_data;
+	dfudev = stream->dfudev;
+	mutex_lock(&dfudev->lock);
+	if (dfudev->gone) {
+		retv = -ENODEV;
+		goto exit_10;
+	}
+	if (stream->mode == DFU_STREAM_DNLOAD && !stream->error) {
+		if (stream->blklen > 0)
+			stream->error = dfu_stream_flush(stream);
+		if (!stream->error)
+			stream->error = dfu_manifest(dfudev, stream->blknum, 1);
+		if (!stream->error) {
+			dfu_stats_end(&dfudev->stats);
+			stream->mode = DFU_STREAM_NONE;
+			stream->blknum = 0;
+		}
+	}
+	retv = stream->error;
+
+exit_10:
+	mutex_unlock(&dfudev->lock);
+	return retv;
+}
+
+static int dfu_job_dnload(struct dfu_device *dfudev, char *buf)
+{
+	struct dfu_job *job = &dfudev->job;
+	loff_t pos;
+	int blknum, len, dfu_state, retv;
+
+	dfu_state = dfu_get_state(dfudev);
+	if (dfu_state != dfuIDLE) {
+		dev_err(&dfudev->intf->dev, "Incompatible State: %d\n",
+				dfu_state);
+		return -EPROTO;
+	}
+	pos = job->offset;
+	blknum = 0;
+	while (job->done < job->total) {
+		if (READ_ONCE(job->cancel)) {
+			dfu_abort(dfudev);
+			return -ECANCELED;
+		}
+		len = job->total - job->done < dfudev->xfersize?
+			job->total - job->done : dfudev->xfersize;
+		retv = kernel_read(job->image, buf, len, &pos);
+		if (retv != len)
+			return retv < 0? retv : -EIO;
+		retv = dfu_dnload_block(dfudev, blknum, buf, len);
+		if (retv)
+			return retv;
+		WRITE_ONCE(job->done, job->done + len);
+		blknum += 1;
+	}
+	return dfu_manifest(dfudev, blknum, 0);
+}
+
+static int dfu_job_verify(struct dfu_device *dfudev, char *buf)
+{
+	struct dfu_job *job = &dfudev->job;
+	char *devbuf = buf + dfudev->xfersize;
+	loff_t pos;
+	int blknum, len, dfu_state, retv, fast;
+
+	dfu_state = dfu_get_state(dfudev);
+	if (dfu_state != dfuIDLE) {
+		dev_err(&dfudev->intf->dev, "Cannot verify in state: %d\n",
+				dfu_state);
+		return -EPROTO;
+	}
+	WRITE_ONCE(job->done, 0);
+	WRITE_ONCE(job->state, DFU_JOB_VERIFY_RUN);
+	fast = READ_ONCE(fast_upload);
+	pos = job->offset;
+	blknum = 0;
+	dfu_state = dfuUPLOAD_IDLE;
+	while (job->done < job->total && dfu_state == dfuUPLOAD_IDLE) {
+		if (READ_ONCE(job->cancel)) {
+			dfu_abort(dfudev);
+			return -ECANCELED;
+		}
+		len = job->total - job->done < dfudev->xfersize?
+			job->total - job->done : dfudev->xfersize;
+		retv = kernel_read(job->image, buf, len, &pos);
+		if (retv != len)
+			return retv < 0? retv : -EIO;
+		dfu_state = dfu_upload_block(dfudev, blknum, devbuf, len, fast);
+		if (dfu_state < 0)
+			return dfu_state;
+		if (dfudev->prictrl.nxfer != len ||
+				memcmp(buf, devbuf, len) != 0) {
+			dev_err(&dfudev->intf->dev, "Verify failed in block " \
+					"%d\n", blknum);
+			if (dfu_state == dfuUPLOAD_IDLE)
+				dfu_abort(dfudev);
+			return -EIO;
+		}
+		WRITE_ONCE(job->done, job->done + len);
+		blknum += 1;
+	}
+	if (dfu_state == dfuUPLOAD_IDLE)
+		dfu_abort(dfudev);
+	return 0;
+}
+
+static void dfu_job_work(struct work_struct *work)
+{
+	struct dfu_job *job;
+	struct dfu_device *dfudev;
+	struct eventfd_ctx *evfd;
+	struct file *image;
+	char *buf;
+	int retv;
+
+	job = container_of(work, struct dfu_job, work);
+	dfudev = container_of(job, struct dfu_device, job);
+	buf = kmalloc(2 * dfudev->xfersize, GFP_KERNEL);
+	if (!buf) {
+		retv = -ENOMEM;
+		goto exit_10;
+	}
+	mutex_lock(&dfudev->lock);
+	if (dfudev->gone) {
+		retv = -ENODEV;
+	} else {
+		dfu_stats_begin(&dfudev->stats);
+		retv = dfu_job_dnload(dfudev, buf);
+	}
+	if (retv == 0 && (job->flags & DFU_JOB_VERIFY))
+		retv = dfu_job_verify(dfudev, buf);
+	if (retv == 0 && (job->flags & DFU_JOB_RESET))
+		usb_queue_reset_device(dfudev->intf);
+	if (retv && retv != -ECANCELED && !dfudev->gone &&
+			dfu_get_state(dfudev) == dfuERROR)
+		dfu_clear_status(dfudev);
+	if (!dfudev->gone)
+		dfu_stats_end(&dfudev->stats);
+	mutex_unlock(&dfudev->lock);
+	kfree(buf);
+
+exit_10:
+	/*
+	 * Once the state is published dfu_job_submit() may install the
+	 * next job, so take image and evfd out of job first.
+	 */
+	mutex_lock(&dfudev->lock);
+	image = job->image;
+	evfd = job->evfd;
+	job->image = NULL;
+	job->evfd = NULL;
+	WRITE_ONCE(job->error, retv);
+	WRITE_ONCE(job->state, retv? DFU_JOB_FAILED : DFU_JOB_DONE);
+	mutex_unlock(&dfudev->lock);
+	fput(image);
+	if (evfd) {
+		eventfd_signal(evfd, 1);
+		eventfd_ctx_put(evfd);
+	}
+}
+
+static int dfu_job_submit(struct dfu_stream *stream,
+		struct dfu_flash_job __user *argp)
+{
+	struct dfu_device *dfudev = stream->dfudev;
+	struct dfu_job *job = &dfudev->job;
+	struct dfu_flash_job args;
+	struct eventfd_ctx *evfd;
+	struct file *image;
+	loff_t isize;
+	int retv;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+	if ((dfudev->cap & CAN_DOWNLOAD) == 0 || (args.flags &
+			DFU_JOB_VERIFY && (dfudev->cap & CAN_UPLOAD) == 0))
+		return -EOPNOTSUPP;
+	image = fget(args.image_fd);
+	if (!image)
+		return -EBADF;
+	if (!(image->f_mode & FMODE_READ)) {
+		retv = -EBADF;
+		goto err_10;
+	}
+	if (args.length == 0) {
+		isize = i_size_read(file_inode(image));
+		if (isize <= args.offset) {
+			retv = -EINVAL;
+			goto err_10;
+		}
+		args.length = isize - args.offset;
+	}
+	evfd = NULL;
+	if (args.event_fd != -1) {
+		evfd = eventfd_ctx_fdget(args.event_fd);
+		if (IS_ERR(evfd)) {
+			retv = PTR_ERR(evfd);
+			goto err_10;
+		}
+	}
+
+	mutex_lock(&dfudev->lock);
+	if (dfudev->gone) {
+		retv = -ENODEV;
+		goto err_20;
+	}
+	if ((stream->mode != DFU_STREAM_NONE &&
+			stream->mode != DFU_STREAM_JOB) ||
+			job->state == DFU_JOB_DNLOAD ||
+			job->state == DFU_JOB_VERIFY_RUN) {
+		retv = -EBUSY;
+		goto err_20;
+	}
+	stream->mode = DFU_STREAM_JOB;
+	job->image = image;
+	job->evfd = evfd;
+	job->offset = args.offset;
+	job->total = args.length;
+	job->done = 0;
+	job->flags = args.flags;
+	job->error = 0;
+	job->cancel = 0;
+	job->state = DFU_JOB_DNLOAD;
+	queue_work(system_unbound_wq, &job->work);
+	mutex_unlock(&dfudev->lock);
+	return 0;
+
+err_20:
+	mutex_unlock(&dfudev->lock);
+	if (evfd)
+		eventfd_ctx_put(evfd);
+err_10:
+	fput(image);
+	return retv;
+}
+
+static long dfu_stream_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct dfu_stream *stream;
+	struct dfu_job *job;
+	struct dfu_job_status status;
+
+	stream = filp->private_data;
+	job = &stream->dfudev->job;
+	switch (cmd) {
+	case DFU_IOC_FLASH_SUBMIT:
+		return dfu_job_submit(stream, (void __user *)arg);
+	case DFU_IOC_FLASH_STATUS:
+		memset(&status, 0, sizeof(status));
+		status.state = READ_ONCE(job->state);
+		status.error = READ_ONCE(job->error);
+		status.done = READ_ONCE(job->done);
+		status.total = job->total;
+		if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+			return -EFAULT;
+		return 0;
+	case DFU_IOC_FLASH_CANCEL:
+		WRITE_ONCE(job->cancel, 1);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations dfu_stream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dfu_stream_open,
+	.release	= dfu_stream_release,
+	.read_iter	= dfu_stream_read,
+	.write_iter	= dfu_stream_write,
+	.fsync		= dfu_stream_fsync,
+	.unlocked_ioctl	= dfu_stream_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.llseek		= no_llseek,
+};
+
+struct dfu_group;
+
+struct dfu_member {
+	struct work_struct work;
+	struct dfu_group *group;
+	struct file *filp;
+	struct dfu_stream *stream;
+	u64 done;
+	int blknum;
+	int state;
+	int error;
+};
+
+/*
+ * The image written to a group is staged once, in chunks that stay put
+ * until the group is closed. Each member has its own worker that sends
+ * the staged data at the pace of its device.
+ */
+struct dfu_group {
+	struct mutex lock;
+	spinlock_t slock;
+	wait_queue_head_t waitq;
+	char **chunks;
+	u64 staged;
+	int committed;
+	int cancel;
+	int nmembers;
+	struct dfu_member members[DFU_GROUP_MAX];
+};
+
+static void dfu_group_copy(struct dfu_group *group, u64 off, char *dst,
+		int len)
+{
+	int coff, n;
+
+	while (len > 0) {
+		coff = off % DFU_GROUP_CHUNK;
+		n = DFU_GROUP_CHUNK - coff < len? DFU_GROUP_CHUNK - coff : len;
+		memcpy(dst, group->chunks[off / DFU_GROUP_CHUNK] + coff, n);
+		dst += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static void dfu_member_work(struct work_struct *work)
+{
+	struct dfu_member *member;
+	struct dfu_group *group;
+	struct dfu_stream *stream;
+	struct dfu_device *dfudev;
+	u64 staged;
+	int committed, len, retv;
+
+	member = container_of(work, struct dfu_member, work);
+	group = member->group;
+	stream = member->stream;
+	dfudev = stream->dfudev;
+	while (member->state == DFU_JOB_DNLOAD && !READ_ONCE(group->cancel)) {
+		spin_lock(&group->slock);
+		staged = group->staged;
+		committed = group->committed;
+		spin_unlock(&group->slock);
+		len = staged - member->done < stream->xfersize?
+			staged - member->done : stream->xfersize;
+		if (len < stream->xfersize && !committed)
+			break;
+
+		mutex_lock(&dfudev->lock);
+		if (dfudev->gone) {
+			retv = -ENODEV;
+		} else if (len == 0) {
+			retv = dfu_manifest(dfudev, member->blknum, 1);
+		} else {
+			dfu_group_copy(group, member->done, stream->blkbuf, len);
+			stream->blknum = member->blknum;
+			stream->blklen = len;
+			retv = dfu_stream_flush(stream);
+		}
+		mutex_unlock(&dfudev->lock);
+
+		if (retv || len == 0) {
+			WRITE_ONCE(member->error, retv);
+			WRITE_ONCE(member->state, retv? DFU_JOB_FAILED :
+					DFU_JOB_DONE);
+			wake_up_interruptible(&group->waitq);
+			break;
+		}
+		WRITE_ONCE(member->done, member->done + len);
+		member->blknum += 1;
+	}
+}
+
+static void dfu_group_kick(struct dfu_group *group)
+{
+	int i;
+
+	for (i = 0; i < group->nmembers; i++)
+		queue_work(system_unbound_wq, &group->members[i].work);
+}
+
+static int dfu_group_open(struct inode *inode, struct file *filp)
+{
+	struct dfu_group *group;
+
+	group = kzalloc(sizeof(struct dfu_group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+	group->chunks = kcalloc(DFU_GROUP_MAXSIZE / DFU_GROUP_CHUNK,
+			sizeof(char *), GFP_KERNEL);
+	if (!group->chunks) {
+		kfree(group);
+		return -ENOMEM;
+	}
+	mutex_init(&group->lock);
+	spin_lock_init(&group->slock);
+	init_waitqueue_head(&group->waitq);
+	filp->private_data = group;
+	return 0;
+}
+
+static int dfu_group_release(struct inode *inode, struct file *filp)
+{
+	struct dfu_group *group;
+	struct dfu_member *member;
+	struct dfu_device *dfudev;
+	int i, dfu_state;
+
+	group = filp->private_data;
+	WRITE_ONCE(group->cancel, 1);
+	for (i = 0; i < group->nmembers; i++) {
+		member = group->members + i;
+		cancel_work_sync(&member->work);
+		dfudev = member->stream->dfudev;
+		mutex_lock(&dfudev->lock);
+		if (member->state == DFU_JOB_DNLOAD && !dfudev->gone) {
+			dfu_state = dfu_get_state(dfudev);
+			if (dfu_state == dfuERROR)
+				dfu_clear_status(dfudev);
+			else if (dfu_state == dfuDNLOAD_IDLE)
+				dfu_abort(dfudev);
+		}
+		if (member->stream->mode == DFU_STREAM_GROUP && !dfudev->gone)
+			dfu_stats_end(&dfudev->stats);
+		member->stream->mode = DFU_STREAM_NONE;
+		mutex_unlock(&dfudev->lock);
+		fput(member->filp);
+	}
+	for (i = 0; i < DFU_GROUP_MAXSIZE / DFU_GROUP_CHUNK; i++)
+		kfree(group->chunks[i]);
+	kfree(group->chunks);
+	kfree(group);
+	filp->private_data = NULL;
+	return 0;
+}
+
+static ssize_t dfu_group_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dfu_group *group;
+	u64 staged;
+	size_t numb;
+	int idx, coff, len, retv;
+
+	group = iocb->ki_filp->private_data;
+	numb = 0;
+	retv = 0;
+	mutex_lock(&group->lock);
+	if (group->committed) {
+		retv = -EPIPE;
+		goto exit_10;
+	}
+	staged = group->staged;
+	while (iov_iter_count(from) > 0) {
+		if (staged == DFU_GROUP_MAXSIZE) {
+			retv = -EFBIG;
+			break;
+		}
+		idx = staged / DFU_GROUP_CHUNK;
+		coff = staged % DFU_GROUP_CHUNK;
+		if (!group->chunks[idx]) {
+			group->chunks[idx] = kmalloc(DFU_GROUP_CHUNK,
+					GFP_KERNEL);
+			if (!group->chunks[idx]) {
+				retv = -ENOMEM;
+				break;
+			}
+		}
+		len = DFU_GROUP_CHUNK - coff;
+		if (len > iov_iter_count(from))
+			len = iov_iter_count(from);
+		len = copy_from_iter(group->chunks[idx] + coff, len, from);
+		if (len == 0) {
+			retv = -EFAULT;
+			break;
+		}
+		staged += len;
+		numb += len;
+	}
+	spin_lock(&group->slock);
+	group->staged = staged;
+	spin_unlock(&group->slock);
+	dfu_group_kick(group);
+
+exit_10:
+	mutex_unlock(&group->lock);
+	iocb->ki_pos += numb;
+	return numb? numb : retv;
+}
+
+static int dfu_group_add(struct dfu_group *group, int fd)
+{
+	struct dfu_member *member;
+	struct dfu_stream *stream;
+	struct dfu_device *dfudev;
+	struct file *filp;
+	int retv;
+
+	filp = fget(fd);
+	if (!filp)
+		return -EBADF;
+	if (filp->f_op != &dfu_stream_fops) {
+		retv = -EINVAL;
+		goto err_10;
+	}
+	stream = filp->private_data;
+	dfudev = stream->dfudev;
+	mutex_lock(&group->lock);
+	if (group->committed || group->nmembers == DFU_GROUP_MAX) {
+		retv = -EBUSY;
+		goto err_20;
+	}
+	mutex_lock(&dfudev->lock);
+	if (stream->mode != DFU_STREAM_NONE)
+		retv = -EBUSY;
+	else
+		retv = dfu_stream_start(stream, DFU_STREAM_GROUP,
+				CAN_DOWNLOAD);
+	mutex_unlock(&dfudev->lock);
+	if (retv)
+		goto err_20;
+
+	member = group->members + group->nmembers;
+	member->group = group;
+	member->filp = filp;
+	member->stream = stream;
+	member->done = 0;
+	member->blknum = 0;
+	member->error = 0;
+	member->state = DFU_JOB_DNLOAD;
+	INIT_WORK(&member->work, dfu_member_work);
+	retv = group->nmembers;
+	group->nmembers += 1;
+	queue_work(system_unbound_wq, &member->work);
+	mutex_unlock(&group->lock);
+	return retv;
+
+err_20:
+	mutex_unlock(&group->lock);
+err_10:
+	fput(filp);
+	return retv;
+}
+
+static long dfu_group_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct dfu_group *group;
+	struct dfu_member *member;
+	struct dfu_member_status status;
+	int fd;
+
+	group = filp->private_data;
+	switch (cmd) {
+	case DFU_IOC_GROUP_ADD:
+		if (get_user(fd, (int __user *)arg))
+			return -EFAULT;
+		return dfu_group_add(group, fd);
+	case DFU_IOC_GROUP_COMMIT:
+		mutex_lock(&group->lock);
+		spin_lock(&group->slock);
+		group->committed = 1;
+		spin_unlock(&group->slock);
+		dfu_group_kick(group);
+		mutex_unlock(&group->lock);
+		return 0;
+	case DFU_IOC_GROUP_STATUS:
+		if (copy_from_user(&status, (void __user *)arg,
+					sizeof(status)))
+			return -EFAULT;
+		if (status.index >= READ_ONCE(group->nmembers))
+			return -EINVAL;
+		member = group->members + status.index;
+		status.state = READ_ONCE(member->state);
+		status.error = READ_ONCE(member->error);
+		status.done = READ_ONCE(member->done);
+		if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Readable once the image is committed and every member has finished,
+ * one way or the other.
+ */
+static __poll_t dfu_group_poll(struct file *filp, poll_table *wait)
+{
+	struct dfu_group *group;
+	int i, nmembers;
+
+	group = filp->private_data;
+	poll_wait(filp, &group->waitq, wait);
+	if (!READ_ONCE(group->committed))
+		return 0;
+	nmembers = READ_ONCE(group->nmembers);
+	for (i = 0; i < nmembers; i++)
+		if (READ_ONCE(group->members[i].state) == DFU_JOB_DNLOAD)
+			return 0;
+	return EPOLLIN | EPOLLRDNORM;
+}
+
+static const struct file_operations dfu_group_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dfu_group_open,
+	.release	= dfu_group_release,
+	.write_iter	= dfu_group_write,
+	.poll		= dfu_group_poll,
+	.unlocked_ioctl	= dfu_group_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice dfu_group_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= DFUDEV_NAME"-group",
+	.fops		= &dfu_group_fops,
+};
+
+static int dfu_create_node(struct dfu_device *dfudev)
+{
+	int minor, retv;
+
+	mutex_lock(&dfu_minor_lock);
+	for (minor = 0; minor < MAX_DFUS; minor++)
+		if (!dfu_minors[minor])
+			break;
+	if (minor == MAX_DFUS) {
+		mutex_unlock(&dfu_minor_lock);
+		dev_err(&dfudev->intf->dev, "Maximum supported USB DFU " \
+				"reached: %d\n", MAX_DFUS);
+		return -ENODEV;
+	}
+	dfudev->devno = MKDEV(MAJOR(dfu_devno), minor);
+	dfudev->cdev = cdev_alloc();
+	if (!dfudev->cdev) {
+		retv = -ENOMEM;
+		goto err_10;
+	}
+	dfudev->cdev->ops = &dfu_stream_fops;
+	dfudev->cdev->owner = THIS_MODULE;
+	retv = cdev_add(dfudev->cdev, dfudev->devno, 1);
+	if (retv) {
+		dev_err(&dfudev->intf->dev, "Cannot add device: %d\n", retv);
+		goto err_20;
+	}
+	dfudev->sysdev = device_create(dfu_class, &dfudev->intf->dev,
+			dfudev->devno, dfudev, DFUDEV_NAME"%d", minor);
+	if (IS_ERR(dfudev->sysdev)) {
+		retv = (int)PTR_ERR(dfudev->sysdev);
+		dev_err(&dfudev->intf->dev, "Cannot create device file: %d\n",
+				retv);
+		goto err_20;
+	}
+	dfu_minors[minor] = dfudev;
+	mutex_unlock(&dfu_minor_lock);
+	return 0;
+
+err_20:
+	cdev_del(dfudev->cdev);
+err_10:
+	dfudev->cdev = NULL;
+	mutex_unlock(&dfu_minor_lock);
+	return retv;
+}
+
+static void dfu_remove_node(struct dfu_device *dfudev)
+{
+	if (!dfudev->cdev)
+		return;
+	mutex_lock(&dfu_minor_lock);
+	dfu_minors[MINOR(dfudev->devno)] = NULL;
+	mutex_unlock(&dfu_minor_lock);
+	device_destroy(dfu_class, dfudev->devno);
+	cdev_del(dfudev->cdev);
+	dfudev->cdev = NULL;
+}
+
+static ssize_t fmsize_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	return sprintf(buf, "%lu", dfudev->fmattr.size);
+}
+
+static ssize_t fmsize_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t buflen)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+	char *tmpbuf, *endchr;
+
+	tmpbuf = kmalloc(buflen+1, GFP_KERNEL);
+	if (!tmpbuf) {
+		dev_err(dev, "Out of Memory\n");
+		return -ENOMEM;
+	}
+	memcpy(tmpbuf, buf, buflen);
+	tmpbuf[buflen] = 0;
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	mutex_lock(&dfudev->lock);
+	dfudev->fmattr.size = simple_strtoul(tmpbuf, &endchr, 10);
+	mutex_unlock(&dfudev->lock);
+	kfree(tmpbuf);
+	return buflen;
+}
+
+static DEVICE_ATTR_RW(fmsize);
+
+static ssize_t xfersize_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	return sprintf(buf, "%d\n", dfudev->xfersize);
+}
+
+/*
+ * Block numbers are derived from the transfer size, so it can only change
+ * while no upload or download is in progress.
+ */
+static ssize_t xfersize_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t buflen)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+	int size, dfu_state, retv;
+
+	retv = kstrtoint(buf, 0, &size);
+	if (retv)
+		return retv;
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	if (!dfu_valid_xfersize(dfudev->usbdev, dfudev->wxfersize, size)) {
+		dev_err(dev, "Invalid transfer size: %d\n", size);
+		return -EINVAL;
+	}
+	mutex_lock(&dfudev->lock);
+	dfu_state = dfu_get_state(dfudev);
+	if (dfu_state != dfuIDLE) {
+		dev_err(dev, "Cannot change transfer size in state: %d\n",
+				dfu_state);
+		retv = -EBUSY;
+	} else {
+		dfudev->xfersize = size;
+		retv = buflen;
+	}
+	mutex_unlock(&dfudev->lock);
+	return retv;
+}
+
+static ssize_t sweep_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+	ssize_t retv;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	if ((dfudev->cap & CAN_UPLOAD) == 0)
+		return -EOPNOTSUPP;
+	mutex_lock(&dfudev->lock);
+	retv = dfu_xfersize_sweep(&dfudev->auxctrl, dfudev->wxfersize,
+			urb_timeout, buf);
+	mutex_unlock(&dfudev->lock);
+	return retv;
+}
+
+static ssize_t cache_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return dfu_cache_show(buf);
+}
+
+static ssize_t flash_cached_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t buflen)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+	struct dfu_image *img;
+	u8 digest[DFU_DIGEST_SIZE];
+	int retv;
+
+	if (buflen < 2 * DFU_DIGEST_SIZE ||
+			hex2bin(digest, buf, DFU_DIGEST_SIZE))
+		return -EINVAL;
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	if ((dfudev->cap & CAN_DOWNLOAD) == 0)
+		return -EOPNOTSUPP;
+	img = dfu_cache_get(digest);
+	if (!img)
+		return -ENOENT;
+	mutex_lock(&dfudev->lock);
+	dfu_stats_begin(&dfudev->stats);
+	retv = dfu_dnload_buffer(&dfudev->auxctrl, img->data, img->size,
+			dfudev->xfersize, urb_timeout);
+	dfu_stats_end(&dfudev->stats);
+	if (retv == dfuMANIFEST_WAIT_RESET)
+		usb_queue_reset_device(dfudev->intf);
+	mutex_unlock(&dfudev->lock);
+	if (retv >= 0)
+		dev_info(dev, "Cached image flashed, %zu bytes\n", img->size);
+	dfu_cache_put(img);
+	return retv < 0? retv : buflen;
+}
+
+static ssize_t urb_timeouts_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu_device *dfudev;
+	struct usb_interface *intf;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	dfudev = usb_get_intfdata(intf);
+	return dfu_rto_show(&dfudev->rto, NULL, buf);
+}
+
+static DEVICE_ATTR_RW(xfersize);
+static DEVICE_ATTR_ADMIN_RO(sweep);
+static DEVICE_ATTR_RO(urb_timeouts);
+static DEVICE_ATTR_RO(cache);
+static DEVICE_ATTR_WO(flash_cached);
+
+static int dfu_create_attrs(struct dfu_device *dfudev)
+{
+	int retv;
+
+	dfudev->attrs = 0;
+	if (dfudev->proto == USB_DFU_PROTO_RUNTIME) {
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_detach);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->detach_attr = 1;
+	} else {
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_status);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->status_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev,
+				&dev_attr_refresh);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->refresh_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_fmsize);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->fmsize_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_abort);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->abort_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev,
+				&dev_attr_xfersize);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->xfersize_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_sweep);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->sweep_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev, &dev_attr_cache);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->cache_attr = 1;
+		retv = device_create_file(&dfudev->intf->dev,
+				&dev_attr_flash_cached);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->flash_cached_attr = 1;
+		sysfs_bin_attr_init(&dfudev->fmattr);
+		dfudev->fmattr.attr.name = "firmware";
+		dfudev->fmattr.attr.mode = 0644;
+		dfudev->fmattr.size = 0;
+		dfudev->fmattr.read = firmware_read;
+		dfudev->fmattr.write = firmware_write;
+		retv = sysfs_create_bin_file(&dfudev->intf->dev.kobj,
+				&dfudev->fmattr);
+		if (unlikely(retv != 0))
+			dev_warn(&dfudev->intf->dev,
+					"Cannot create sysfs file %d\n", retv);
+		else
+			dfudev->firmware_attr = 1;
 	}
-	dfudev = kmalloc(sizeof(struct dfu_device), GFP_KERNEL);
+	retv = device_create_file(&dfudev->intf->dev, &dev_attr_urb_timeouts);
+	if (unlikely(retv != 0))
+		dev_warn(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+	else
+		dfudev->urb_timeouts_attr = 1;
+	retv = device_create_file(&dfudev->intf->dev, &dev_attr_capbility);
+	if (unlikely(retv != 0))
+		dev_warn(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+	else
+		dfudev->capbility_attr = 1;
+	return retv;
+}
+
+static void dfu_remove_attrs(struct dfu_device *dfudev)
+{
+	if (dfudev->detach_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_detach);
+	if (dfudev->firmware_attr)
+		sysfs_remove_bin_file(&dfudev->intf->dev.kobj, &dfudev->fmattr);
+	if (dfudev->flash_cached_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_flash_cached);
+	if (dfudev->cache_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_cache);
+	if (dfudev->sweep_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_sweep);
+	if (dfudev->xfersize_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_xfersize);
+	if (dfudev->abort_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_abort);
+	if (dfudev->fmsize_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_fmsize);
+	if (dfudev->refresh_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_refresh);
+	if (dfudev->status_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_status);
+	if (dfudev->capbility_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_capbility);
+	if (dfudev->urb_timeouts_attr)
+		device_remove_file(&dfudev->intf->dev, &dev_attr_urb_timeouts);
+}
+
+static int dfu_probe(struct usb_interface *intf,
+			const struct usb_device_id *id)
+{
+	int retv, dfufdsc_len, resp;
+	struct dfu_device *dfudev;
+	struct dfufdsc *dfufdsc;
+	struct urb *urb;
+
+	retv = 0;
+	dfufdsc = (struct dfufdsc *)intf->cur_altsetting->extra;
+	dfufdsc_len = intf->cur_altsetting->extralen;
+	if (!dfufdsc || dfufdsc_len != USB_DFU_FUNC_DSCLEN ||
+			dfufdsc->dsctyp != USB_DFU_FUNC_DSCTYP) {
+		dev_err(&intf->dev, "Invalid DFU functional descriptor\n");
+		return -ENODEV;
+	}
+	dfudev = kzalloc(sizeof(struct dfu_device), GFP_KERNEL);
 	if (!dfudev)
 		return -ENOMEM;
 
 	dfudev->cap = dfufdsc->attr;
 	dfudev->xfersize = le16_to_cpu(dfufdsc->xfersize);
+	dfudev->wxfersize = dfudev->xfersize;
 	dfudev->dettmout = dfufdsc->tmout;
 	dfudev->intf = intf;
 	dfudev->usbdev = interface_to_usbdev(intf);
@@ -767,42 +2001,81 @@ static int dfu_probe(struct usb_interface *intf,
 		dfudev->dma = 1;
 	else
 		dfudev->dma = 0;
-	dfudev->urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dfudev->urb) {
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
 		retv = -ENOMEM;
 		goto err_10;
 	}
+	dfu_init_control(&dfudev->prictrl, intf, urb);
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		retv = -ENOMEM;
+		goto err_20;
+	}
+	dfu_init_control(&dfudev->auxctrl, intf, urb);
+	dfu_rto_init(&dfudev->rto, urb_timeout);
+	dfudev->prictrl.rto = &dfudev->rto;
+	dfudev->auxctrl.rto = &dfudev->rto;
+	retv = dfu_stats_init(&dfudev->stats, intf, NULL);
+	if (retv)
+		goto err_30;
+	dfudev->prictrl.stats = &dfudev->stats;
+	dfudev->auxctrl.stats = &dfudev->stats;
+	dfudev->stats.notify = "status";
+	dfudev->pacer.stats = &dfudev->stats;
+	init_usb_anchor(&dfudev->submitted);
+	INIT_WORK(&dfudev->job.work, dfu_job_work);
 	mutex_init(&dfudev->lock);
 
         usb_set_intfdata(intf, dfudev);
 	dfu_create_attrs(dfudev);
 	if (dfudev->proto == USB_DFU_PROTO_DFUMODE) {
+		if (dfu_create_node(dfudev))
+			dev_warn(&dfudev->intf->dev, "No device file, only " \
+					"sysfs firmware access\n");
 		resp = dfu_get_status(dfudev);
-		if (dfudev->status.bState != dfuIDLE)
+		if (dfudev->auxctrl.dfuStatus.bState != dfuIDLE)
 			dev_warn(&dfudev->intf->dev, "Not in idle state: %d\n",
-					dfudev->status.bState);
+					dfudev->auxctrl.dfuStatus.bState);
 	}
 	dev_info(&dfudev->intf->dev, "USB DFU inserted, CAN: %02x PROTO: %d, " \
 			"Poll Time Out: %d\n", (int)dfudev->cap, dfudev->proto,
-			wmsec2int(dfudev->status.wmsec));
+			wmsec2int(dfudev->auxctrl.dfuStatus.wmsec));
 	return retv;
 
+err_30:
+	usb_free_urb(dfudev->auxctrl.dfurb);
+err_20:
+	usb_free_urb(dfudev->prictrl.dfurb);
 err_10:
 	kfree(dfudev);
 	return retv;
 }
 
+/*
+ * An open /dev/sdfuN keeps dfudev alive, the last close frees it.
+ */
 static void dfu_disconnect(struct usb_interface *intf)
 {
 	struct dfu_device *dfudev;
+	int opened;
 
 	dfudev = usb_get_intfdata(intf);
+	dfu_remove_node(dfudev);
 	mutex_lock(&dfudev->lock);
 	usb_set_intfdata(intf, NULL);
 	dfu_remove_attrs(dfudev);
-	usb_free_urb(dfudev->urb);
+	usb_kill_anchored_urbs(&dfudev->submitted);
+	usb_free_urb(dfudev->auxctrl.dfurb);
+	usb_free_urb(dfudev->prictrl.dfurb);
+	dfu_stats_destroy(&dfudev->stats);
+	kvfree(dfudev->capbuf);
+	dfudev->capbuf = NULL;
+	dfudev->gone = 1;
+	opened = dfudev->opened;
 	mutex_unlock(&dfudev->lock);
-	kfree(dfudev);
+	if (!opened)
+		kfree(dfudev);
 }
 
 static struct usb_driver dfu_driver = {
@@ -816,18 +2089,45 @@ static int __init usbdfu_init(void)
 {
 	int retv;
 
+	retv = alloc_chrdev_region(&dfu_devno, 0, MAX_DFUS, DFUDEV_NAME);
+	if (retv != 0) {
+		pr_err("Cannot allocate a char major number: %d\n", retv);
+		return retv;
+	}
+	dfu_class = class_create(THIS_MODULE, DFUDEV_NAME);
+	if (IS_ERR(dfu_class)) {
+		retv = (int)PTR_ERR(dfu_class);
+		pr_err("Cannot create DFU class, Out of Memory!\n");
+		goto err_10;
+	}
+	retv = misc_register(&dfu_group_dev);
+	if (retv) {
+		pr_err("Cannot register DFU group device: %d\n", retv);
+		goto err_20;
+	}
         retv = usb_register(&dfu_driver);
 	if (retv) {
 		pr_err("Cannot register USB DFU driver: %d\n", retv);
-		return retv;
+		goto err_30;
 	}
 
         return 0;
+
+err_30:
+	misc_deregister(&dfu_group_dev);
+err_20:
+	class_destroy(dfu_class);
+err_10:
+	unregister_chrdev_region(dfu_devno, MAX_DFUS);
+	return retv;
 }
 
 static void __exit usbdfu_exit(void)
 {
 	usb_deregister(&dfu_driver);
+	misc_deregister(&dfu_group_dev);
+	class_destroy(dfu_class);
+	unregister_chrdev_region(dfu_devno, MAX_DFUS);
 }
 
 module_init(usbdfu_init);
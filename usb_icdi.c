@@ -14,6 +14,10 @@
 #include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include "usbdfu.h"
+
+#define CREATE_TRACE_POINTS
+#include "icdi_trace.h"
 
 #define MODULE_NAME	"usb_icdi"
 
@@ -22,6 +26,13 @@
 
 #define MAX_FMSIZE	(0x7ful << 56)
 
+/* timeout classes, a reply is timed by the command that asked for it */
+#define ICDI_OP_SEND	0
+#define ICDI_OP_REPLY	1
+#define ICDI_OP_ERASE	2
+#define ICDI_OP_FLASH	3
+#define ICDI_ERASE_TMOUT	2000	/* milliseconds, until learned */
+
 struct flash_block {
 	unsigned int offset;
 	unsigned int nxtpos;
@@ -35,12 +46,16 @@ struct icdi_device {
 	struct usb_interface *intf;
 	struct completion urbdone;
 	struct urb *urb;
+	ktime_t done;
+	struct dfu_rto rto;
+	struct dfu_stats stats;
 	int intfnum;
 	int pipe_in, pipe_out;
 	volatile int resp, nxfer;
 	unsigned int erase_size;
 	int partno;
 	struct flash_block flash;
+	struct bin_attribute fmattr;
 	union {
 		unsigned char attrs;
 		struct {
@@ -50,6 +65,7 @@ struct icdi_device {
 			unsigned int debug_attr:1;
 			unsigned int in_debug:1;
 			unsigned int stalled:1;
+			unsigned int urb_timeouts_attr:1;
 		};
 	};
 };
@@ -61,8 +77,12 @@ MODULE_DESCRIPTION("TI USB ICDI Driver");
 
 static int urb_timeout = 200; /* milliseconds */
 module_param(urb_timeout, int, 0644);
-MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout. "
-	"Default: 200 milliseconds.");
+MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout until one has "
+	"been learned for the device. Default: 200 milliseconds.");
+
+static const char *const icdi_op_names[DFU_RTO_CLASSES] = {
+	"SEND", "REPLY", "ERASE", "FLASH"
+};
 
 static const uint32_t FP_CTRL	= 0xe0002000;
 static const uint32_t DID0	= 0x400fe000;
@@ -97,6 +117,7 @@ static void icdi_urb_done(struct urb *urb)
 	icdi = urb->context;
 	icdi->resp = urb->status;
 	icdi->nxfer = urb->actual_length;
+	icdi->done = ktime_get();
 	complete(&icdi->urbdone);
 }
 
@@ -122,25 +143,36 @@ static ssize_t debug_show(struct device *dev,
 		struct device_attribute *attr, char *buf);
 static ssize_t debug_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t buflen);
+static ssize_t urb_timeouts_show(struct device *dev,
+		struct device_attribute *attr, char *buf);
 
-static BIN_ATTR_RW(firmware, 0);
 static DEVICE_ATTR_RW(fmsize);
 static DEVICE_ATTR_RW(debug);
 static DEVICE_ATTR_RO(version);
+static DEVICE_ATTR_RO(urb_timeouts);
 
 static ssize_t fmsize_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", bin_attr_firmware.size);
+	struct icdi_device *icdi;
+	struct usb_interface *intf;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	icdi = usb_get_intfdata(intf);
+	return sprintf(buf, "%lu\n", icdi->fmattr.size);
 }
 
 static ssize_t fmsize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t buflen)
 {
+	struct icdi_device *icdi;
+	struct usb_interface *intf;
 	char *tmpbuf, *endchr;
 
-	if (bin_attr_firmware.size != 0) {
-		dev_warn(dev, "Firmware Size already set: %lu. Unable to modify\n", bin_attr_firmware.size);
+	intf = container_of(dev, struct usb_interface, dev);
+	icdi = usb_get_intfdata(intf);
+	if (icdi->fmattr.size != 0) {
+		dev_warn(dev, "Firmware Size already set: %lu. Unable to modify\n", icdi->fmattr.size);
 		return buflen;
 	}
 	tmpbuf = kmalloc(buflen+1, GFP_KERNEL);
@@ -150,7 +182,9 @@ static ssize_t fmsize_store(struct device *dev,
 	}
 	memcpy(tmpbuf, buf, buflen);
 	tmpbuf[buflen] = 0;
-	bin_attr_firmware.size = simple_strtoul(tmpbuf, &endchr, 10);
+	mutex_lock(&icdi->lock);
+	icdi->fmattr.size = simple_strtoul(tmpbuf, &endchr, 10);
+	mutex_unlock(&icdi->lock);
 	kfree(tmpbuf);
 	return buflen;
 }
@@ -247,56 +281,84 @@ static int usb_send(struct icdi_device *icdi, char *urbuf, int inflen)
 {
 	int retv = 0;
 	unsigned long jiff_wait;
+	ktime_t start;
 
 	usb_fill_bulk_urb(icdi->urb, icdi->usbdev, icdi->pipe_out,
 			urbuf, inflen, icdi_urb_done, icdi);
 	init_completion(&icdi->urbdone);
 	icdi->resp = -255;
 	icdi->nxfer = 0;
+	start = ktime_get();
 	retv = usb_submit_urb(icdi->urb, GFP_KERNEL);
 	if (unlikely(retv != 0)) {
 		dev_err(&icdi->intf->dev, "URB bulk write submit failed: %d\n", retv);
 		return retv;
 	}
-	jiff_wait = msecs_to_jiffies(urb_timeout);
+	jiff_wait = msecs_to_jiffies(dfu_rto_get(&icdi->rto, ICDI_OP_SEND,
+				inflen));
 	if (!wait_for_completion_timeout(&icdi->urbdone, jiff_wait)) {
 		icdi_urb_timeout(icdi);
+		dfu_rto_expired(&icdi->rto, ICDI_OP_SEND);
 		dev_warn(&icdi->intf->dev, "URB bulk write operation timeout\n");
 	}
 	retv = icdi->resp;
+	trace_icdi_send(icdi->intf, urbuf, inflen, icdi->nxfer, retv,
+			ktime_us_delta(icdi->done, start));
+	dfu_stats_urb(&icdi->stats, ICDI_OP_SEND, 0, icdi->nxfer, retv,
+			ktime_us_delta(icdi->done, start));
+	dfu_rec_add(&icdi->stats, ICDI_OP_SEND, 0, inflen, icdi->nxfer, retv,
+			start, ktime_us_delta(icdi->done, start),
+			DFU_REC_NOSTATE, DFU_REC_NOSTATE);
+	if (retv == 0)
+		dfu_rto_sample(&icdi->rto, ICDI_OP_SEND, inflen,
+				ktime_us_delta(icdi->done, start));
 	if (unlikely(retv < 0))
 		dev_err(&icdi->intf->dev, "URB bulk write operation failed: %d\n", retv);
 	return retv;
 }
 
-static int usb_recv(struct icdi_device *icdi, char *urbuf, int buflen)
+static int usb_recv(struct icdi_device *icdi, char *urbuf, int buflen,
+		int op)
 {
 	int retv = 0;
 	unsigned long jiff_wait;
+	ktime_t start;
 
 	usb_fill_bulk_urb(icdi->urb, icdi->usbdev, icdi->pipe_in,
 			urbuf, buflen, icdi_urb_done, icdi);
 	init_completion(&icdi->urbdone);
 	icdi->resp = -255;
 	icdi->nxfer = 0;
+	start = ktime_get();
 	retv = usb_submit_urb(icdi->urb, GFP_KERNEL);
 	if (unlikely(retv < 0)) {
 		dev_err(&icdi->intf->dev, "URB bulk read submit failed: %d\n", retv);
 		return retv;
 	}
-	jiff_wait = msecs_to_jiffies(urb_timeout);
+	jiff_wait = msecs_to_jiffies(dfu_rto_get(&icdi->rto, op, 0));
 	if (!wait_for_completion_timeout(&icdi->urbdone, jiff_wait)) {
 		icdi_urb_timeout(icdi);
+		dfu_rto_expired(&icdi->rto, op);
 		dev_warn(&icdi->intf->dev, "URB bulk read operation timeout\n");
 	}
 	retv = icdi->resp;
+	trace_icdi_recv(icdi->intf, urbuf, buflen, icdi->nxfer, retv,
+			ktime_us_delta(icdi->done, start));
+	dfu_stats_urb(&icdi->stats, op, 1, icdi->nxfer, retv,
+			ktime_us_delta(icdi->done, start));
+	dfu_rec_add(&icdi->stats, op, 0, buflen, icdi->nxfer, retv, start,
+			ktime_us_delta(icdi->done, start),
+			DFU_REC_NOSTATE, DFU_REC_NOSTATE);
+	if (retv == 0)
+		dfu_rto_sample(&icdi->rto, op, 0,
+				ktime_us_delta(icdi->done, start));
 	if (unlikely(retv < 0))
 		dev_err(&icdi->intf->dev, "URB bulk read failed: %d\n", retv);
 	return retv;
 }
 
 static int do_usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
-		int buflen)
+		int buflen, int op)
 {
 	int retv, pos;
 
@@ -306,7 +368,8 @@ static int do_usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
 	pos = 0;
 	urbuf[0] = '+';
 	do {
-		retv = usb_recv(icdi, urbuf+pos, buflen-pos);
+		retv = usb_recv(icdi, urbuf+pos, buflen-pos,
+				pos? ICDI_OP_REPLY : op);
 		if (retv < 0)
 			break;
 		pos += icdi->nxfer;
@@ -321,9 +384,10 @@ static int do_usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
 static int usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
 		int buflen)
 {
-	int retv, len, resend;
+	int retv, len, resend, op, resends;
 	char *curchr, sum, check;
 	char *cmd;
+	ktime_t start;
 
 	cmd = kmalloc(inflen+1, GFP_KERNEL);
 	if (unlikely(!cmd)) {
@@ -331,10 +395,17 @@ static int usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
 		return -ENOMEM;
 	}
 	memcpy(cmd, urbuf, inflen);
-
+	op = ICDI_OP_REPLY;
+	if (inflen > 12 && memcmp(cmd, "$vFlashErase", 12) == 0)
+		op = ICDI_OP_ERASE;
+	else if (inflen > 12 && memcmp(cmd, "$vFlashWrite", 12) == 0)
+		op = ICDI_OP_FLASH;
+
+	start = ktime_get();
+	resends = 0;
 	do {
 		resend = 0;
-		retv = do_usb_sndrcv(icdi, urbuf, inflen, buflen);
+		retv = do_usb_sndrcv(icdi, urbuf, inflen, buflen, op);
 		if (retv < 0) {
 			cmd[inflen+1] = 0;
 			dev_err(&icdi->intf->dev, "command %s failed: %d\n",
@@ -342,9 +413,12 @@ static int usb_sndrcv(struct icdi_device *icdi, char *urbuf, int inflen,
 			break;
 		} else if (urbuf[0] == '-') {
 			resend = 1;
+			resends += 1;
 			memcpy(urbuf, cmd, inflen);
 		}
 	} while (resend == 1);
+	trace_icdi_sndrcv(icdi->intf, cmd, inflen, retv, resends,
+			ktime_us_delta(ktime_get(), start));
 	if (retv < 0)
 		goto exit_10;
 
@@ -721,7 +795,7 @@ static ssize_t debug_show(struct device *dev,
 static ssize_t debug_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t stlen)
 {
-	int max_cmdlen, len, cmdlen, retv, buflen;
+	int max_cmdlen, len, cmdlen, retv, buflen, was_debug;
 	char cmd[16], *urbuf;
 	struct usb_interface *intf;
 	struct icdi_device *icdi;
@@ -742,6 +816,7 @@ static ssize_t debug_store(struct device *dev,
 	intf = container_of(dev, struct usb_interface, dev);
 	icdi = usb_get_intfdata(intf);
 	mutex_lock(&icdi->lock);
+	was_debug = icdi->in_debug;
 	buflen = 128;
 	urbuf = kmalloc(buflen, GFP_KERNEL);
 	if (unlikely(!urbuf)) {
@@ -764,19 +839,24 @@ static ssize_t debug_store(struct device *dev,
 			if (!icdi->flash.block) {
 				dev_err(dev, "Out Of Memory\n");
 				retv = -ENOMEM;
-			} else
+			} else {
+				dfu_stats_begin(&icdi->stats);
 				retv = stlen;
+			}
 		}
 	} else if (memcmp(leave_debug, buf, cmdlen) == 0) {
 		if (icdi->in_debug == 0)
 			goto exit_20;
 		if (icdi->stalled) {
 			retv = write_block(icdi, 1);
+			if (retv != 0)
+				dfu_rec_dump(&icdi->stats);
 			kfree(icdi->flash.block);
 			icdi->flash.block = NULL;
 		}
 		if (retv != 0)
 			dev_err(dev, "Cannot program the last block\n");
+		dfu_stats_end(&icdi->stats);
 		retv = stop_debug(icdi, urbuf, buflen);
 		if (retv != 0)
 			dev_err(dev, "Cannot leave debug state\n");
@@ -788,6 +868,9 @@ static ssize_t debug_store(struct device *dev,
 	}
 exit_20:
 	kfree(urbuf);
+	if (icdi->in_debug != was_debug)
+		dfu_snap_announce(&icdi->stats, "debug", "ICDI_DEBUG=%d",
+				icdi->in_debug);
 
 exit_10:
 	mutex_unlock(&icdi->lock);
@@ -826,11 +909,11 @@ static int get_erase_size(struct icdi_device *icdi)
 	switch(icdi->partno) {
 	case 0x2d:
 		icdi->erase_size = 16384;
-		bin_attr_firmware.size = 1048576;
+		icdi->fmattr.size = 1048576;
 		break;
 	case 0xa1:
 		icdi->erase_size = 1024;
-		bin_attr_firmware.size = 262144;
+		icdi->fmattr.size = 262144;
 		break;
 	default:
 		icdi->erase_size = 4096;
@@ -1010,6 +1093,17 @@ exit_10:
 	return retv;
 }
 
+static ssize_t urb_timeouts_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct icdi_device *icdi;
+	struct usb_interface *intf;
+
+	intf = container_of(dev, struct usb_interface, dev);
+	icdi = usb_get_intfdata(intf);
+	return dfu_rto_show(&icdi->rto, icdi_op_names, buf);
+}
+
 static int icdi_create_attrs(struct icdi_device *icdi)
 {
 	int retv;
@@ -1033,8 +1127,18 @@ static int icdi_create_attrs(struct icdi_device *icdi)
 				"Cannot create sysfs file 'debug' %d\n", retv);
 	else
 		icdi->debug_attr = 1;
-	retv = sysfs_create_bin_file(&icdi->intf->dev.kobj,
-			&bin_attr_firmware);
+	retv = device_create_file(&icdi->intf->dev, &dev_attr_urb_timeouts);
+	if (unlikely(retv != 0))
+		dev_warn(&icdi->intf->dev,
+			"Cannot create sysfs file 'urb_timeouts' %d\n", retv);
+	else
+		icdi->urb_timeouts_attr = 1;
+	sysfs_bin_attr_init(&icdi->fmattr);
+	icdi->fmattr.attr.name = "firmware";
+	icdi->fmattr.attr.mode = 0644;
+	icdi->fmattr.read = firmware_read;
+	icdi->fmattr.write = firmware_write;
+	retv = sysfs_create_bin_file(&icdi->intf->dev.kobj, &icdi->fmattr);
 	if (unlikely(retv != 0))
 		dev_warn(&icdi->intf->dev,
 				"Cannot create sysfs file %d\n", retv);
@@ -1058,8 +1162,10 @@ static void icdi_remove_attrs(struct icdi_device *icdi)
 		device_remove_file(&icdi->intf->dev, &dev_attr_fmsize);
 	if (icdi->debug_attr)
 		device_remove_file(&icdi->intf->dev, &dev_attr_debug);
+	if (icdi->urb_timeouts_attr)
+		device_remove_file(&icdi->intf->dev, &dev_attr_urb_timeouts);
 	if (icdi->firmware_attr)
-		sysfs_remove_bin_file(&icdi->intf->dev.kobj, &bin_attr_firmware);
+		sysfs_remove_bin_file(&icdi->intf->dev.kobj, &icdi->fmattr);
 /*	if (icdi->abort_attr)
 		device_remove_file(&icdi->intf->dev, &dev_attr_abort);
 	if (icdi->status_attr)
@@ -1077,7 +1183,7 @@ static int icdi_probe(struct usb_interface *intf,
 	struct usb_host_endpoint *ep;
 	struct usb_host_interface *host_intf;
 
-	icdi = kmalloc(sizeof(struct icdi_device), GFP_KERNEL);
+	icdi = kzalloc(sizeof(struct icdi_device), GFP_KERNEL);
 	if (!icdi)
 		return -ENOMEM;
 	retv = 0;
@@ -1111,6 +1217,11 @@ static int icdi_probe(struct usb_interface *intf,
 		goto err_10;
 	}
 	mutex_init(&icdi->lock);
+	dfu_rto_init(&icdi->rto, urb_timeout);
+	icdi->rto.cls[ICDI_OP_ERASE].init_ms = ICDI_ERASE_TMOUT;
+	retv = dfu_stats_init(&icdi->stats, intf, icdi_op_names);
+	if (retv)
+		goto err_20;
         usb_set_intfdata(intf, icdi);
 	get_erase_size(icdi);
 	icdi->flash.block = NULL;
@@ -1118,6 +1229,8 @@ static int icdi_probe(struct usb_interface *intf,
 	dev_info(&icdi->intf->dev, "TI USB ICDI board '%02X' inserted. Erase Size: %d\n", icdi->partno, icdi->erase_size);
 	return retv;
 
+err_20:
+	usb_free_urb(icdi->urb);
 err_10:
 	kfree(icdi);
 	return retv;
@@ -1133,6 +1246,7 @@ static void icdi_disconnect(struct usb_interface *intf)
 		kfree(icdi->flash.block);
 	usb_set_intfdata(intf, NULL);
 	icdi_remove_attrs(icdi);
+	dfu_stats_destroy(&icdi->stats);
 	usb_free_urb(icdi->urb);
 	mutex_unlock(&icdi->lock);
 	kfree(icdi);
@@ -9,6 +9,12 @@
  *
 */
 #include <linux/usb.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/ioctl.h>
+#include <linux/kref.h>
+#include <linux/list.h>
 
 #define USB_DFU_DETACH		0
 #define USB_DFU_DNLOAD		1
@@ -26,6 +32,69 @@
 #define USB_DFU_FUNC_DSCTYP	0x21
 #define USB_DFU_ERROR_CODE	65535
 
+#define USB_DFU_FUNC_DOWN	0x21
+#define USB_DFU_FUNC_UP		0xa1
+
+#define DFU_XFERSIZE_MAX	0xffff
+#define DFU_SWEEP_MAXSIZE	16384
+#define DFU_SWEEP_BYTES		(32*1024)
+
+#define DFU_IOC_MAGIC		'D'
+#define DFU_IOC_GET_XFERSIZE	_IOR(DFU_IOC_MAGIC, 1, int)
+#define DFU_IOC_SET_XFERSIZE	_IOW(DFU_IOC_MAGIC, 2, int)
+
+/*
+ * Flash job: program length bytes of image_fd, starting at offset in the
+ * file, in a kernel worker. event_fd, if not -1, is an eventfd signalled
+ * when the job has ended; DFU_IOC_FLASH_STATUS tells how it went.
+ */
+#define DFU_JOB_VERIFY		1	/* read the image back and compare */
+#define DFU_JOB_RESET		2	/* reset into the new firmware */
+
+struct dfu_flash_job {
+	__s32 image_fd;
+	__s32 event_fd;
+	__u64 offset;
+	__u64 length;		/* 0: up to the end of the file */
+	__u32 flags;
+	__u32 pad;
+};
+
+#define DFU_JOB_IDLE		0
+#define DFU_JOB_DNLOAD		1
+#define DFU_JOB_VERIFY_RUN	2
+#define DFU_JOB_DONE		3
+#define DFU_JOB_FAILED		4
+
+struct dfu_job_status {
+	__u64 done;		/* bytes of the current phase */
+	__u64 total;
+	__s32 state;
+	__s32 error;
+};
+
+#define DFU_IOC_FLASH_SUBMIT	_IOW(DFU_IOC_MAGIC, 3, struct dfu_flash_job)
+#define DFU_IOC_FLASH_STATUS	_IOR(DFU_IOC_MAGIC, 4, struct dfu_job_status)
+#define DFU_IOC_FLASH_CANCEL	_IO(DFU_IOC_MAGIC, 5)
+
+/*
+ * Group flashing through /dev/sdfu-group: every open /dev/sdfuN added with
+ * DFU_IOC_GROUP_ADD receives the image written to the group file. The
+ * members download independently; DFU_IOC_GROUP_COMMIT marks the end of
+ * the image. index is the value returned by DFU_IOC_GROUP_ADD.
+ */
+struct dfu_member_status {
+	__u32 index;
+	__s32 state;		/* DFU_JOB_DNLOAD, DFU_JOB_DONE, DFU_JOB_FAILED */
+	__s32 error;
+	__u32 pad;
+	__u64 done;
+};
+
+#define DFU_IOC_GROUP_ADD	_IOW(DFU_IOC_MAGIC, 6, int)
+#define DFU_IOC_GROUP_COMMIT	_IO(DFU_IOC_MAGIC, 7)
+#define DFU_IOC_GROUP_STATUS	_IOWR(DFU_IOC_MAGIC, 8, struct dfu_member_status)
+
 #define USB_DFU_INTERFACE_INFO(v, cl, sc, pr) \
         .match_flags = USB_DEVICE_ID_MATCH_VENDOR | \
 			USB_DEVICE_ID_MATCH_INT_INFO, \
@@ -64,6 +133,9 @@ enum dfu_state {
 	dfuERROR = 10
 };
 
+struct dfu_control;
+typedef void (*dfu_complete_t)(struct dfu_control *ctrl);
+
 struct dfu_control {
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
@@ -76,6 +148,13 @@ struct dfu_control {
 	int nxfer;
 	struct urb *dfurb;
 	void *datbuf;
+	struct dfu_control *next;	/* submitted when this one succeeds */
+	struct usb_anchor *anchor;
+	dfu_complete_t complete;	/* called in URB completion context */
+	void *context;
+	struct dfu_rto *rto;		/* learns this device's timeouts */
+	struct dfu_stats *stats;	/* counts this device's transfers */
+	ktime_t start, done;
 	union {
 		unsigned long ocupy[8];
 		struct dfu_status dfuStatus;
@@ -84,6 +163,316 @@ struct dfu_control {
 	};
 };
 
+static inline int wmsec2int(unsigned char *wmsec)
+{
+	return (wmsec[2] << 16)|(wmsec[1] << 8) | wmsec[0];
+}
+
+/*
+ * The descriptor's wTransferSize is always accepted. Anything else must be
+ * a whole number of ep0 packets that still fits in wLength.
+ */
+static inline int dfu_valid_xfersize(struct usb_device *usbdev, int wxfersize,
+		int size)
+{
+	int mps;
+
+	if (size == wxfersize)
+		return 1;
+	mps = usb_endpoint_maxp(&usbdev->ep0.desc);
+	return mps > 0 && size >= mps && size <= DFU_XFERSIZE_MAX &&
+		size % mps == 0;
+}
+
+#define DFU_PACE_MIN_US		100
+#define DFU_PACE_DEADLINE_MS	1000
+
+/*
+ * GETSTATUS pacing while a device is busy. busy_us is the learned time one
+ * block keeps the device busy, so the first poll is sent when the block
+ * should be done rather than after the full bwPollTimeout.
+ */
+struct dfu_pacer {
+	unsigned int busy_us;
+	ktime_t start;
+	ktime_t deadline;
+	int polls;
+	int learn;
+	int tmout;		/* bwPollTimeout the wait began with */
+	struct dfu_stats *stats;
+};
+
+#define DFU_RTO_CLASSES		8
+#define DFU_RTO_UNIT		1024
+#define DFU_RTO_MIN_MS		200
+#define DFU_RTO_MAX_MS		10000
+#define DFU_RTO_MAXSHIFT	5
+
+/*
+ * URB timeouts learned per device, one estimator per operation class: the
+ * DFU bRequest, or whatever numbering the driver gives its operations.
+ * As in TCP, srtt is kept times 8 and rttvar times 4, in microseconds for
+ * each DFU_RTO_UNIT bytes of payload plus one. The timeout is srtt plus
+ * four mean deviations scaled to the payload, doubled for every timeout
+ * since the last good sample. init_ms is used until the first sample.
+ * Like TCP's RTO, the result never drops below min_ms, the init_ms given
+ * to dfu_rto_init() but at least DFU_RTO_MIN_MS, so a slow hub or a
+ * scheduling hiccup does not unlink a transfer that is merely late.
+ */
+struct dfu_rto_class {
+	u32 srtt;
+	u32 rttvar;
+	u32 samples;
+	u32 backoff;
+	int init_ms;
+};
+
+struct dfu_rto {
+	spinlock_t lock;
+	int min_ms;
+	struct dfu_rto_class cls[DFU_RTO_CLASSES];
+};
+
+#define DFU_HIST_BUCKETS	16
+#define DFU_HIST_SHIFT		6	/* the first bucket ends at 64 us */
+
+/*
+ * Transfer statistics of a device in debugfs, dfu/<interface>/stats.
+ * The counters are per CPU so the I/O path only bumps its own copy;
+ * reading adds them up and writing to the file zeroes them. Operation
+ * classes are those of struct dfu_rto. A session is one upload or
+ * download, bracketed by dfu_stats_begin() and dfu_stats_end().
+ */
+struct dfu_stats_cpu {
+	u64 bytes[2];		/* out, in */
+	u64 blocks[2];
+	u64 errors[DFU_RTO_CLASSES];
+	u64 hist[DFU_RTO_CLASSES][DFU_HIST_BUCKETS];
+	u64 busy_waits;
+	u64 busy_us;		/* measured in dfuDNLOAD_BUSY */
+	u64 poll_us;		/* bwPollTimeout reported for those waits */
+	u64 polls;
+};
+
+#define DFU_REC_SIZE		64	/* a power of two */
+#define DFU_REC_NOSTATE		0xff
+
+/*
+ * Flight recorder: the last DFU_REC_SIZE transactions of a device, in
+ * debugfs as dfu/<interface>/recorder. Writers claim a slot by bumping
+ * head and publish it by setting seq to the claim number last, so
+ * neither side takes a lock; a reader skips slots that change under it.
+ */
+struct dfu_rec_entry {
+	unsigned long seq;
+	u64 ts;			/* ns, monotonic, at submission */
+	u32 usecs;
+	s32 status;
+	u16 value;
+	u16 len;
+	u16 nxfer;
+	u8 cls;
+	u8 bstatus;		/* of a GETSTATUS, or DFU_REC_NOSTATE */
+	u8 bstate;		/* of a GETSTATUS or GETSTATE */
+};
+
+struct dfu_recorder {
+	atomic_long_t head;
+	int state;		/* last DFU state seen */
+	struct dfu_rec_entry ent[DFU_REC_SIZE];
+};
+
+/*
+ * Last status seen by the I/O path, so that sysfs readers need neither
+ * the device lock nor a request on ep0. done counts the bytes of the
+ * current session.
+ */
+struct dfu_snapval {
+	ktime_t when;		/* of the last state, 0 if none yet */
+	u64 done;
+	int bstatus;
+	int bstate;
+	int wmsec;
+};
+
+struct dfu_snapshot {
+	seqlock_t lock;
+	struct dfu_snapval v;
+	int phase;		/* last state announced, see dfu_snap_update */
+};
+
+struct dfu_stats {
+	struct dfu_stats_cpu __percpu *cpu;
+	struct dentry *dir;
+	struct device *dev;
+	const char *const *names;
+	spinlock_t lock;	/* session fields */
+	ktime_t sess_start;
+	u64 sess_base;
+	u64 last_bytes;
+	u64 last_usecs;
+	unsigned long sessions;
+	struct dfu_recorder rec;
+	struct dfu_snapshot snap;
+	const char *notify;	/* attribute to sysfs_notify, or NULL */
+};
+
+#define DFU_POOL_SIZE	4
+
+struct dfu_pool {
+	spinlock_t lock;
+	struct usb_interface *intf;
+	struct dfu_rto *rto;		/* given to every control handed out */
+	struct dfu_stats *stats;
+	struct dfu_control *ctrls;
+	unsigned long freemap;
+	unsigned long hits;
+	unsigned long misses;
+	int size;
+};
+
+static inline void dfu_init_control(struct dfu_control *ctrl,
+		struct usb_interface *intf, struct urb *urb)
+{
+	ctrl->usbdev = interface_to_usbdev(intf);
+	ctrl->intf = intf;
+	ctrl->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
+	ctrl->dfurb = urb;
+	ctrl->datbuf = NULL;
+	ctrl->len = 0;
+	ctrl->next = NULL;
+	ctrl->anchor = NULL;
+	ctrl->complete = NULL;
+	ctrl->context = NULL;
+	ctrl->rto = NULL;
+	ctrl->stats = NULL;
+}
+
+static inline void dfu_fill_control(struct dfu_control *ctrl, __u8 reqtype,
+		__u8 request, __u16 value, void *datbuf, int len)
+{
+	ctrl->req.bRequestType = reqtype;
+	ctrl->req.bRequest = request;
+	ctrl->req.wIndex = cpu_to_le16(ctrl->intfnum);
+	ctrl->req.wValue = cpu_to_le16(value);
+	ctrl->req.wLength = cpu_to_le16(len);
+	if (reqtype & USB_DIR_IN)
+		ctrl->pipe = usb_rcvctrlpipe(ctrl->usbdev, 0);
+	else
+		ctrl->pipe = usb_sndctrlpipe(ctrl->usbdev, 0);
+	ctrl->datbuf = datbuf;
+	ctrl->len = len;
+}
+
+/*
+ * dfu_submit_urb() sends one control request and sleeps until it is done.
+ * dfu_submit_async() only queues ctrl; every ctrl->next in the chain is
+ * submitted from the completion of its predecessor, so e.g. a DNLOAD and
+ * its GETSTATUS go out back-to-back. dfu_wait_urb() waits for the whole
+ * chain and returns the first failure.
+ */
 int dfu_submit_urb(struct dfu_control *ctrl, int tmout);
+int dfu_submit_async(struct dfu_control *ctrl, struct usb_anchor *anchor,
+		gfp_t mem_flags);
+int dfu_wait_urb(struct dfu_control *ctrl, int tmout);
+int dfu_wait_anchor(struct usb_anchor *anchor, int tmout);
+
+/*
+ * A control with rto set waits for as long as dfu_rto_get() says, using
+ * bRequest as the class, and feeds its round-trip time back; tmout only
+ * applies to controls without one. names label the classes in
+ * dfu_rto_show(), NULL for the DFU requests.
+ */
+void dfu_rto_init(struct dfu_rto *rto, int init_ms);
+int dfu_rto_get(struct dfu_rto *rto, int cls, int len);
+void dfu_rto_sample(struct dfu_rto *rto, int cls, int len, s64 usecs);
+void dfu_rto_expired(struct dfu_rto *rto, int cls);
+ssize_t dfu_rto_show(struct dfu_rto *rto, const char *const *names,
+		char *buf);
+
+ktime_t dfu_pace_begin(struct dfu_pacer *pacer, int tmout, int learn);
+ktime_t dfu_pace_next(struct dfu_pacer *pacer, int tmout);
+void dfu_pace_end(struct dfu_pacer *pacer);
+void dfu_pace_sleep(ktime_t until);
+
+int dfu_stats_init(struct dfu_stats *stats, struct usb_interface *intf,
+		const char *const *names);
+void dfu_stats_destroy(struct dfu_stats *stats);
+void dfu_stats_urb(struct dfu_stats *stats, int cls, int in, int len,
+		int status, s64 usecs);
+void dfu_stats_begin(struct dfu_stats *stats);
+void dfu_stats_end(struct dfu_stats *stats);
+
+/*
+ * dfu_stats_end() dumps the recorder to the kernel log when the last
+ * state seen was dfuERROR, dfu_rec_dump() does so unconditionally.
+ */
+void dfu_rec_add(struct dfu_stats *stats, int cls, int value, int len,
+		int nxfer, int status, ktime_t start, s64 usecs,
+		int bstatus, int bstate);
+void dfu_rec_dump(struct dfu_stats *stats);
+
+/*
+ * Replies to GETSTATUS and GETSTATE, and the dfuIDLE implied by a good
+ * CLRSTATUS or ABORT, update the snapshot from dfu_wait_urb(); a driver
+ * that learns the state otherwise reports it with dfu_snap_state().
+ */
+void dfu_snap_state(struct dfu_stats *stats, int bstate);
+void dfu_snap_announce(struct dfu_stats *stats, const char *attr,
+		const char *fmt, ...) __printf(3, 4);
+void dfu_snap_read(struct dfu_stats *stats, struct dfu_snapval *val);
+
+static inline int dfu_pace_expired(struct dfu_pacer *pacer)
+{
+	return ktime_after(ktime_get(), pacer->deadline);
+}
+
+/*
+ * Control blocks with their URBs, allocated at probe time. dfu_pool_get()
+ * falls back to kmalloc when all of them are in use and counts a miss.
+ */
+int dfu_pool_init(struct dfu_pool *pool, struct usb_interface *intf, int size);
+void dfu_pool_destroy(struct dfu_pool *pool);
+struct dfu_control *dfu_pool_get(struct dfu_pool *pool);
+void dfu_pool_put(struct dfu_pool *pool, struct dfu_control *ctrl);
+ssize_t dfu_pool_show(struct dfu_pool *pool, char *buf);
+
+/*
+ * Time a short UPLOAD at each candidate transfer size and print the
+ * KiB/s reached by each one, followed by the fastest size. The device
+ * is left in dfuIDLE.
+ */
+ssize_t dfu_xfersize_sweep(struct dfu_control *ctrl, int wxfersize, int tmout,
+		char *buf);
+
+/*
+ * Download a whole image held in memory, ending with the zero length
+ * DNLOAD and manifestation. Returns the final DFU state, dfuIDLE or
+ * dfuMANIFEST_WAIT_RESET, or a negative error after clearing or
+ * aborting what the download left behind.
+ */
+int dfu_dnload_buffer(struct dfu_control *ctrl, const u8 *data, size_t size,
+		int xfersize, int tmout);
+
+#define DFU_DIGEST_SIZE	32
+
+/*
+ * Images flashed recently, keyed by SHA-256 and shared by all devices.
+ * dfu_cache_insert() takes over a kvmalloc()ed image; dfu_cache_get()
+ * returns a referenced entry to be released with dfu_cache_put().
+ */
+struct dfu_image {
+	struct list_head lru;
+	struct kref ref;
+	u8 digest[DFU_DIGEST_SIZE];
+	size_t size;
+	u8 *data;
+};
+
+void dfu_cache_insert(u8 *data, size_t size);
+struct dfu_image *dfu_cache_get(const u8 *digest);
+void dfu_cache_put(struct dfu_image *img);
+size_t dfu_cache_limit(void);
+ssize_t dfu_cache_show(char *buf);
 
 #endif /* LINUX_USB_DFU_DSCAO__ */
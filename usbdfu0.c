@@ -20,8 +20,8 @@ MODULE_DESCRIPTION("USB DFU Class Driver for Protocol 0");
 
 static int urb_timeout = 200; /* milliseconds */
 module_param(urb_timeout, int, 0644);
-MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout value. "
-	"Default 200 milliseconds.");
+MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout value until one "
+	"has been learned for the device. Default 200 milliseconds.");
 
 static int detach_timeout = 2000; /* 2 seconds */
 module_param(detach_timeout, int, 0644);
@@ -62,25 +62,16 @@ static ssize_t dfu_switch(struct device *dev, struct device_attribute *attr,
 	struct dfu_control *ctrl;
 
 	dfudev = container_of(attr, struct dfu0_device, tachattr);
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
+	ctrl = dfu_pool_get(&dfudev->pool);
 	if (!ctrl)
 		return -ENOMEM;
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
-		return -ENOMEM;
-	}
 
 	if (count > 0 && *buf == '-' && (*(buf+1) == '\n' || *(buf+1) == 0))
 		dfu_do_switch(dfudev, ctrl);
 	else
 		dev_err(dev, "Invalid Command: %c\n", *buf);
 
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_pool_put(&dfudev->pool, ctrl);
 	return count;
 }
 
@@ -113,6 +104,24 @@ static ssize_t dfu_xfersize_show(struct device *dev,
 	return sprintf(buf, "%d\n", dfudev->xfersize);
 }
 
+static ssize_t dfu_pool_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu0_device *dfudev;
+
+	dfudev = container_of(attr, struct dfu0_device, poolattr);
+	return dfu_pool_show(&dfudev->pool, buf);
+}
+
+static ssize_t dfu_rto_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu0_device *dfudev;
+
+	dfudev = container_of(attr, struct dfu0_device, rtoattr);
+	return dfu_rto_show(&dfudev->rto, NULL, buf);
+}
+
 static int dfu_create_attrs(struct dfu0_device *dfudev)
 {
 	int retv = 0;
@@ -157,9 +166,33 @@ static int dfu_create_attrs(struct dfu0_device *dfudev)
 				retv);
 		goto err_30;
 	}
+	dfudev->poolattr.attr.name = "pool";
+	dfudev->poolattr.attr.mode = 0444;
+	dfudev->poolattr.show = dfu_pool_stat_show;
+	dfudev->poolattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->poolattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_40;
+	}
+	dfudev->rtoattr.attr.name = "urb_timeouts";
+	dfudev->rtoattr.attr.mode = 0444;
+	dfudev->rtoattr.show = dfu_rto_stat_show;
+	dfudev->rtoattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->rtoattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_50;
+	}
 
 	return retv;
 
+err_50:
+	device_remove_file(&dfudev->intf->dev, &dfudev->poolattr);
+err_40:
+	device_remove_file(&dfudev->intf->dev, &dfudev->xsizeattr);
 err_30:
 	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
 err_20:
@@ -171,6 +204,8 @@ err_10:
 
 static void dfu_remove_attrs(struct dfu0_device *dfudev)
 {
+	device_remove_file(&dfudev->intf->dev, &dfudev->rtoattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->poolattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->xsizeattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->attrattr);
@@ -206,11 +241,19 @@ static int dfu_probe(struct usb_interface *intf,
 	dfudev->usbdev = interface_to_usbdev(intf);
 	dfudev->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
 	dfudev->proto = 1;
+	retv = dfu_pool_init(&dfudev->pool, intf, 1);
+	if (retv) {
+		kfree(dfudev);
+		return retv;
+	}
+	dfu_rto_init(&dfudev->rto, urb_timeout);
+	dfudev->pool.rto = &dfudev->rto;
 
 	retv = dfu_create_attrs(dfudev);
-	if (retv)
+	if (retv) {
+		dfu_pool_destroy(&dfudev->pool);
 		kfree(dfudev);
-	else
+	} else
 		usb_set_intfdata(intf, dfudev);
 	return retv;
 }
@@ -222,6 +265,7 @@ static void dfu_disconnect(struct usb_interface *intf)
 	dfudev = usb_get_intfdata(intf);
 	dfu_remove_attrs(dfudev);
 	usb_set_intfdata(dfudev->intf, NULL);
+	dfu_pool_destroy(&dfudev->pool);
 	kfree(dfudev);
 }
 
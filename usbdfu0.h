@@ -17,6 +17,10 @@ struct dfu0_device {
 	struct device_attribute attrattr;
 	struct device_attribute tmoutattr;
 	struct device_attribute xsizeattr;
+	struct device_attribute poolattr;
+	struct device_attribute rtoattr;
+	struct dfu_pool pool;
+	struct dfu_rto rto;
 	struct {
 		unsigned int download:1;
 		unsigned int upload:1;
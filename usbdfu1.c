@@ -13,11 +13,13 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/fs.h>
-#include <linux/dma-mapping.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
 #include "usbdfu1.h"
+#include "dfu_trace.h"
 
-#define BLKSIZE	1024
 #define DFUDEV_NAME "dfu"
 
 MODULE_LICENSE("GPL");
@@ -34,8 +36,18 @@ MODULE_PARM_DESC(max_dfus, "Maximum number of USB DFU devices. "
 
 static int urb_timeout = 200; /* milliseconds */
 module_param(urb_timeout, int, 0644);
-MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout. "
-	"Default: 200 milliseconds.");
+MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout until one has "
+	"been learned for the device. Default: 200 milliseconds.");
+
+static int fast_upload = 0;
+module_param(fast_upload, int, 0644);
+MODULE_PARM_DESC(fast_upload, "Upload without a GETSTATUS after each block, "
+	"a short block ends the upload. Default: 0");
+
+static int dnload_retries = 3;
+module_param(dnload_retries, int, 0644);
+MODULE_PARM_DESC(dnload_retries, "Times a failed DNLOAD block is resent "
+	"after recovering the device. Default: 3");
 
 static const struct usb_device_id dfu_ids[] = {
 	{ USB_DFU_INTERFACE_INFO(USB_VENDOR_LUMINARY,
@@ -117,60 +129,453 @@ static inline int dfu_finish_dnload(struct dfu_control *ctrl)
 	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
-static inline unsigned int altrim(unsigned int v, int sf)
+/*
+ * Send the request set up in opctrl, with a GETSTATUS on stctrl chained
+ * right behind it if status is set.
+ */
+static int dfu_xfer_status(struct dfu1_device *dfudev, int status)
+{
+	struct dfu_control *opctrl, *stctrl;
+	int retv;
+
+	opctrl = dfudev->opctrl;
+	stctrl = dfudev->stctrl;
+	dfu_fill_control(stctrl, USB_DFU_FUNC_UP, USB_DFU_GETSTATUS, 0,
+			&stctrl->dfuStatus, sizeof(stctrl->dfuStatus));
+	opctrl->next = status? stctrl : NULL;
+	stctrl->next = NULL;
+	retv = dfu_submit_async(opctrl, &dfudev->submitted, GFP_KERNEL);
+	if (retv == 0)
+		retv = dfu_wait_urb(opctrl, urb_timeout);
+	opctrl->next = NULL;
+	return retv;
+}
+
+/*
+ * Remember the state reported by the last GETSTATUS/GETSTATE, so that
+ * poll() and the state attribute can answer without talking to the
+ * device.
+ */
+static void dfu_set_state(struct dfu1_device *dfudev, int dfust)
+{
+	if (dfust < 0)
+		return;
+	WRITE_ONCE(dfudev->dfust, dfust);
+	dfu_snap_state(&dfudev->stats, dfust);
+	wake_up_interruptible(&dfudev->waitq);
+}
+
+static enum hrtimer_restart dfu_busy_expired(struct hrtimer *t)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(t, struct dfu1_device, busy_timer);
+	wake_up_interruptible(&dfudev->waitq);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Wait until the device leaves dfuDNLOAD_BUSY, polling when the pacer
+ * expects the block to be done. With nowait set, return -EAGAIN instead
+ * of sleeping until then.
+ */
+static int dfu_wait_busy(struct dfu1_device *dfudev, int nowait)
+{
+	struct dfu_control *stctrl;
+
+	stctrl = dfudev->stctrl;
+	if (stctrl->dfuStatus.bState != dfuDNLOAD_BUSY)
+		return 0;
+	for (;;) {
+		if (dfu_pace_expired(&dfudev->pacer)) {
+			dev_err(&dfudev->intf->dev, "DFU Stalled\n");
+			return -ETIMEDOUT;
+		}
+		if (ktime_after(dfudev->busy_until, ktime_get())) {
+			if (nowait) {
+				hrtimer_start(&dfudev->busy_timer,
+						dfudev->busy_until,
+						HRTIMER_MODE_ABS);
+				return -EAGAIN;
+			}
+			dfu_pace_sleep(dfudev->busy_until);
+		}
+		if (dfu_get_status(stctrl))
+			return -EIO;
+		trace_dfu_poll(dfudev->intf, &stctrl->dfuStatus,
+				dfudev->pacer.polls + 1);
+		dfu_set_state(dfudev, stctrl->dfuStatus.bState);
+		if (stctrl->dfuStatus.bState != dfuDNLOAD_BUSY)
+			break;
+		dfudev->busy_until = dfu_pace_next(&dfudev->pacer,
+				wmsec2int(stctrl->dfuStatus.wmsec));
+	}
+	dfu_pace_end(&dfudev->pacer);
+	return 0;
+}
+
+/*
+ * Bring the device back after a failed DNLOAD of block dnblk. Returns 1
+ * if the device turns out to have taken the block, 0 if it is ready to
+ * get the block again, or an error. A device in dfuERROR is cleared back
+ * to dfuIDLE; the block is then resent with its original number, which
+ * is where a device that places data by wBlockNum picks up again.
+ */
+static int dfu_dnload_recover(struct dfu1_device *dfudev, int received)
+{
+	struct dfu_control *stctrl;
+	int dfust;
+
+	stctrl = dfudev->stctrl;
+	if (dfu_get_status(stctrl))
+		return 0;
+	dfust = stctrl->dfuStatus.bState;
+	dfu_set_state(dfudev, dfust);
+	if (dfust == dfuDNLOAD_SYNC || dfust == dfuDNLOAD_BUSY) {
+		received = 1;
+		dfudev->busy_until = dfu_pace_begin(&dfudev->pacer,
+			wmsec2int(stctrl->dfuStatus.wmsec), 1);
+		stctrl->dfuStatus.bState = dfuDNLOAD_BUSY;
+		if (dfu_wait_busy(dfudev, 0))
+			return -EIO;
+		dfust = stctrl->dfuStatus.bState;
+	}
+	if (dfust == dfuERROR) {
+		dev_warn(&dfudev->intf->dev, "Clearing DFU Status: %d\n",
+				stctrl->dfuStatus.bStatus);
+		if (dfu_clr_status(stctrl))
+			return -EIO;
+		dfust = dfuIDLE;
+		received = 0;
+		dfu_set_state(dfudev, dfust);
+	}
+	if (dfust == dfuDNLOAD_IDLE)
+		return received;
+	if (dfust == dfuIDLE)
+		return 0;
+	return -EPROTO;
+}
+
+/*
+ * Send datbuf as block dnblk. Blocks below dnblk have been acknowledged
+ * and datbuf is kept until this one is, so a transfer that fails is
+ * resent from here after dfu_dnload_recover(), up to dnload_retries times.
+ */
+static int dfu_flush_block(struct dfu1_device *dfudev, int nowait)
 {
-	return (((v -1) >> sf) + 1) << sf;
+	struct dfu_control *opctrl, *stctrl;
+	int retv, dfust, retry;
+
+	opctrl = dfudev->opctrl;
+	stctrl = dfudev->stctrl;
+	retv = dfu_wait_busy(dfudev, nowait);
+	if (retv)
+		return retv;
+	if (dfudev->dnblk == 0) {
+		dfust = dfu_get_state(stctrl);
+		dfu_set_state(dfudev, dfust);
+		if (dfust != dfuIDLE && dfust != dfuDNLOAD_IDLE) {
+			dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n",
+					dfust);
+			return -EINVAL;
+		}
+	}
+	for (retry = 0; ; retry++) {
+		dfu_fill_control(opctrl, USB_DFU_FUNC_DOWN, USB_DFU_DNLOAD,
+			dfudev->dnblk, dfudev->datbuf, dfudev->dnlen);
+		retv = dfu_xfer_status(dfudev, 1);
+		if (retv == 0 && READ_ONCE(opctrl->nxfer) != dfudev->dnlen)
+			retv = -EIO;
+		if (retv == 0) {
+			dfust = stctrl->dfuStatus.bState;
+			dfu_set_state(dfudev, dfust);
+			if (dfust == dfuDNLOAD_BUSY) {
+				dfudev->busy_until = dfu_pace_begin(
+					&dfudev->pacer,
+					wmsec2int(stctrl->dfuStatus.wmsec), 1);
+				break;
+			}
+			if (dfust == dfuDNLOAD_IDLE)
+				break;
+			dev_err(&dfudev->intf->dev,
+				"Downloading failed. DFU State: %d\n", dfust);
+			retv = -EIO;
+		}
+		if (retry >= READ_ONCE(dnload_retries))
+			return retv;
+		dev_warn(&dfudev->intf->dev, "Block %d failed: %d, retrying\n",
+				dfudev->dnblk, retv);
+		retv = dfu_dnload_recover(dfudev, opctrl->status == 0 &&
+				READ_ONCE(opctrl->nxfer) == dfudev->dnlen);
+		if (retv < 0)
+			return retv;
+		if (retv == 1)
+			break;
+	}
+	dfudev->dnblk += 1;
+	dfudev->dnlen = 0;
+	return 0;
+}
+
+static void dfu_ahead_work(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_ahead *ahead;
+	struct dfu_control *opctrl, *stctrl;
+	int slot, dfust, len, retv;
+
+	ahead = container_of(work, struct dfu_ahead, work);
+	dfudev = container_of(ahead, struct dfu1_device, ahead);
+	opctrl = dfudev->opctrl;
+	stctrl = dfudev->stctrl;
+	for (;;) {
+		spin_lock(&ahead->lock);
+		if (ahead->stop || ahead->eof || ahead->err ||
+				ahead->head - ahead->tail == ahead->depth) {
+			spin_unlock(&ahead->lock);
+			break;
+		}
+		slot = ahead->head % ahead->depth;
+		spin_unlock(&ahead->lock);
+
+		dfu_fill_control(opctrl, USB_DFU_FUNC_UP, USB_DFU_UPLOAD,
+				ahead->blknum, ahead->buf +
+				slot * dfudev->xfersize, dfudev->xfersize);
+		opctrl->dfurb->transfer_dma = ahead->dma +
+			slot * dfudev->xfersize;
+		retv = dfu_xfer_status(dfudev, !ahead->fast);
+		len = READ_ONCE(opctrl->nxfer);
+		if (ahead->fast)
+			dfust = len < dfudev->xfersize? dfuIDLE :
+				dfuUPLOAD_IDLE;
+		else
+			dfust = stctrl->dfuStatus.bState;
+		if (retv == 0 && dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
+			dev_err(&dfudev->intf->dev,
+				"Uploading failed. DFU State: %d\n", dfust);
+			retv = -EIO;
+		}
+		if (retv == 0)
+			dfu_set_state(dfudev, dfust);
+
+		spin_lock(&ahead->lock);
+		if (retv) {
+			ahead->err = retv;
+		} else {
+			ahead->lens[slot] = len;
+			ahead->head += 1;
+			ahead->blknum += 1;
+			if (dfust == dfuIDLE || len < dfudev->xfersize)
+				ahead->eof = 1;
+		}
+		spin_unlock(&ahead->lock);
+		wake_up_interruptible(&dfudev->waitq);
+	}
+}
+
+/*
+ * Start the readahead ring for an upload beginning at offset 0 in
+ * dfuIDLE. Returns 0 without a ring if readahead is turned off.
+ */
+static int dfu_ahead_start(struct dfu1_device *dfudev)
+{
+	struct dfu_ahead *ahead = &dfudev->ahead;
+	int depth;
+
+	depth = READ_ONCE(dfudev->defradepth);
+	if (depth <= 0)
+		return 0;
+	ahead->lens = kcalloc(depth, sizeof(int), GFP_KERNEL);
+	if (!ahead->lens)
+		return -ENOMEM;
+	ahead->buf = usb_alloc_coherent(dfudev->usbdev,
+			depth * dfudev->xfersize, GFP_KERNEL, &ahead->dma);
+	if (!ahead->buf) {
+		kfree(ahead->lens);
+		return -ENOMEM;
+	}
+	ahead->depth = depth;
+	ahead->head = 0;
+	ahead->tail = 0;
+	ahead->pos = 0;
+	ahead->blknum = 0;
+	ahead->fast = READ_ONCE(fast_upload);
+	ahead->eof = 0;
+	ahead->err = 0;
+	ahead->stop = 0;
+	queue_work(system_unbound_wq, &ahead->work);
+	return 0;
+}
+
+static void dfu_ahead_stop(struct dfu1_device *dfudev)
+{
+	struct dfu_ahead *ahead = &dfudev->ahead;
+
+	if (!ahead->buf)
+		return;
+	spin_lock(&ahead->lock);
+	ahead->stop = 1;
+	spin_unlock(&ahead->lock);
+	cancel_work_sync(&ahead->work);
+	usb_free_coherent(dfudev->usbdev, ahead->depth * dfudev->xfersize,
+			ahead->buf, ahead->dma);
+	kfree(ahead->lens);
+	ahead->buf = NULL;
+	ahead->lens = NULL;
+	dfudev->opctrl->datbuf = dfudev->datbuf;
+	dfudev->opctrl->dfurb->transfer_dma = dfudev->datdma;
+}
+
+/*
+ * Serve read() from the readahead ring; no request goes to the device
+ * from here, the worker owns opctrl and stctrl while the ring runs.
+ */
+static ssize_t dfu_ahead_read(struct dfu1_device *dfudev, struct kiocb *iocb,
+		struct iov_iter *to)
+{
+	struct dfu_ahead *ahead = &dfudev->ahead;
+	int slot, len, avail, retv;
+	size_t numb, copied;
+
+	numb = 0;
+	retv = 0;
+	while (iov_iter_count(to) > 0) {
+		spin_lock(&ahead->lock);
+		avail = ahead->head - ahead->tail;
+		if (avail == 0 && (ahead->eof || ahead->err)) {
+			retv = ahead->err;
+			spin_unlock(&ahead->lock);
+			break;
+		}
+		spin_unlock(&ahead->lock);
+		if (avail == 0) {
+			if (numb > 0)
+				break;
+			if (iocb->ki_flags & IOCB_NOWAIT ||
+					iocb->ki_filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			retv = wait_event_interruptible(dfudev->waitq,
+					READ_ONCE(ahead->head) != ahead->tail ||
+					READ_ONCE(ahead->eof) ||
+					READ_ONCE(ahead->err));
+			if (retv)
+				break;
+			continue;
+		}
+		slot = ahead->tail % ahead->depth;
+		len = ahead->lens[slot] - ahead->pos;
+		if (len > iov_iter_count(to))
+			len = iov_iter_count(to);
+		copied = copy_to_iter(ahead->buf + slot * dfudev->xfersize +
+				ahead->pos, len, to);
+		ahead->pos += copied;
+		numb += copied;
+		if (copied != len) {
+			retv = -EFAULT;
+			break;
+		}
+		if (ahead->pos == ahead->lens[slot]) {
+			spin_lock(&ahead->lock);
+			ahead->tail += 1;
+			spin_unlock(&ahead->lock);
+			ahead->pos = 0;
+			queue_work(system_unbound_wq, &ahead->work);
+		}
+	}
+	iocb->ki_pos += numb;
+	return numb? numb : retv;
+}
+
+/*
+ * The device lock for the sysfs commands, refused while a closed session
+ * is still being cleaned up, see dfu_close_work().
+ */
+static int dfu_trylock(struct dfu1_device *dfudev)
+{
+	if (!mutex_trylock(&dfudev->lock))
+		return 0;
+	if (completion_done(&dfudev->closed))
+		return 1;
+	mutex_unlock(&dfudev->lock);
+	return 0;
 }
 
 static int dfu_open(struct inode *inode, struct file *filp)
 {
 	struct dfu1_device *dfudev;
-	int state, retv, buflen;
+	int state, retv;
 	struct dfu_control *ctrl;
-	void *datbuf;
 
 	retv = 0;
 	dfudev = container_of(inode->i_cdev, struct dfu1_device, cdev);
 	filp->private_data = dfudev;
-	if (mutex_lock_interruptible(&dfudev->lock))
-		return -EBUSY;
+	filp->f_mode |= FMODE_NOWAIT;
+	for (;;) {
+		if (mutex_lock_interruptible(&dfudev->lock))
+			return -EBUSY;
+		if (completion_done(&dfudev->closed))
+			break;
+		mutex_unlock(&dfudev->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_for_completion_interruptible(&dfudev->closed))
+			return -EBUSY;
+	}
 
-	buflen = altrim(dfudev->xfersize, 4) + 2*sizeof(struct dfu_control);
-	datbuf = kmalloc(buflen, GFP_KERNEL);
-	if (!datbuf) {
+	dfudev->xfersize = READ_ONCE(dfudev->defxfersize);
+	dfudev->dnlen = 0;
+	dfudev->dnblk = 0;
+	dfudev->dnerr = 0;
+	dfudev->capbuf = NULL;
+	dfudev->caplen = 0;
+	dfudev->capsize = 0;
+	dfudev->capoff = dfu_cache_limit() == 0;
+	/*
+	 * The transfer buffer stays DMA mapped for the whole session, so
+	 * read() and write() never map, sync or unmap it.
+	 */
+	dfudev->datbuf = usb_alloc_coherent(dfudev->usbdev, dfudev->xfersize,
+			GFP_KERNEL, &dfudev->datdma);
+	if (!dfudev->datbuf) {
 		retv = -ENOMEM;
 		goto err_10;
 	}
-	dfudev->datbuf = datbuf;
-	dfudev->opctrl = datbuf + altrim(dfudev->xfersize, 4);
-	dfudev->opctrl->datbuf = datbuf;
-	dfudev->opctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
+	dfudev->opctrl = kcalloc(2, sizeof(struct dfu_control), GFP_KERNEL);
+	if (!dfudev->opctrl) {
+		retv = -ENOMEM;
+		goto err_15;
+	}
+	dfu_init_control(dfudev->opctrl, dfudev->intf,
+			usb_alloc_urb(0, GFP_KERNEL));
 	if (!dfudev->opctrl->dfurb) {
 		retv = -ENOMEM;
 		goto err_20;
 	}
-	dfudev->opctrl->usbdev = dfudev->usbdev;
-	dfudev->opctrl->intf = dfudev->intf;
-	dfudev->opctrl->intfnum = dfudev->intfnum;
-	
+	dfudev->opctrl->datbuf = dfudev->datbuf;
+	dfudev->opctrl->dfurb->transfer_dma = dfudev->datdma;
+	dfudev->opctrl->dfurb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
 	dfudev->stctrl = dfudev->opctrl + 1;
-	dfudev->stctrl->datbuf = NULL;
-	dfudev->stctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
+	dfu_init_control(dfudev->stctrl, dfudev->intf,
+			usb_alloc_urb(0, GFP_KERNEL));
 	if (!dfudev->stctrl->dfurb) {
 		retv = -ENOMEM;
 		goto err_25;
 	}
-	dfudev->stctrl->usbdev = dfudev->usbdev;
-	dfudev->stctrl->intf = dfudev->intf;
-	dfudev->stctrl->intfnum = dfudev->intfnum;
+	dfudev->opctrl->rto = &dfudev->rto;
+	dfudev->stctrl->rto = &dfudev->rto;
+	dfudev->opctrl->stats = &dfudev->stats;
+	dfudev->stctrl->stats = &dfudev->stats;
 
 	ctrl = dfudev->stctrl;
 	state = dfu_get_state(ctrl);
+	dfu_set_state(dfudev, state);
 	if (state != dfuIDLE) {
 		dev_err(&dfudev->intf->dev, "Bad Initial State: %d\n", state);
 		retv =  -EBUSY;
 		goto err_30;
 	}
+	dfu_stats_begin(&dfudev->stats);
 
 	return retv;
 
@@ -179,96 +584,191 @@ err_30:
 err_25:
 	usb_free_urb(dfudev->opctrl->dfurb);
 err_20:
-	kfree(datbuf);
+	kfree(dfudev->opctrl);
+err_15:
+	usb_free_coherent(dfudev->usbdev, dfudev->xfersize, dfudev->datbuf,
+			dfudev->datdma);
 err_10:
 	mutex_unlock(&dfudev->lock);
 	return retv;
 }
 
-static int dfu_release(struct inode *inode, struct file *filp)
+/*
+ * GETSTATUS until the device leaves the download and manifestation
+ * states, sleeping for the bwPollTimeout it asks for in between.
+ * Returns the state it settled in or an error.
+ */
+static int dfu_close_settle(struct dfu1_device *dfudev)
+{
+	struct dfu_control *stctrl;
+	struct dfu_status *status;
+	ktime_t next;
+	int polls;
+
+	stctrl = dfudev->stctrl;
+	status = &stctrl->dfuStatus;
+	for (polls = 0; ; polls++) {
+		if (dfu_get_status(stctrl))
+			return -EIO;
+		if (polls)
+			trace_dfu_poll(dfudev->intf, status, polls);
+		dfu_set_state(dfudev, status->bState);
+		if (status->bState != dfuDNLOAD_SYNC &&
+				status->bState != dfuDNLOAD_BUSY &&
+				status->bState != dfuMANIFEST_SYNC &&
+				status->bState != dfuMANIFEST)
+			break;
+		if (polls == 0)
+			next = dfu_pace_begin(&dfudev->pacer,
+					wmsec2int(status->wmsec), 0);
+		else
+			next = dfu_pace_next(&dfudev->pacer,
+					wmsec2int(status->wmsec));
+		if (dfu_pace_expired(&dfudev->pacer))
+			return -ETIMEDOUT;
+		dfu_pace_sleep(next);
+	}
+	if (polls)
+		dfu_pace_end(&dfudev->pacer);
+	return status->bState;
+}
+
+/*
+ * Finish a closed session: flush and complete a download, or clear or
+ * abort whatever else the device was left in, then free the session.
+ * Until it is done dfu_open() waits and dfu_trylock() fails.
+ */
+static void dfu_close_work(struct work_struct *work)
 {
 	struct dfu1_device *dfudev;
 	struct dfu_control *stctrl;
-	int retv;
+	int retv, finished;
 
-	dfudev = filp->private_data;
+	dfudev = container_of(work, struct dfu1_device, close_work);
 	stctrl = dfudev->stctrl;
+	mutex_lock(&dfudev->lock);
+	dfu_ahead_stop(dfudev);
+	if (dfudev->dnlen > 0 && !dfudev->dnerr)
+		dfu_flush_block(dfudev, 0);
+	dfu_wait_busy(dfudev, 0);
+	dfu_stats_end(&dfudev->stats);
+	finished = 0;
 	retv = dfu_get_state(stctrl);
 	if (retv == dfuDNLOAD_IDLE)
-		dfu_finish_dnload(stctrl);
+		finished = dfu_finish_dnload(stctrl) == 0 && !dfudev->dnerr;
 	else if (retv == dfuERROR)
 		dfu_clr_status(stctrl);
 	else if (retv != dfuIDLE)
 		dfu_abort(stctrl);
-	msleep(100);
-	retv = dfu_get_state(stctrl);
+	retv = dfu_close_settle(dfudev);
+	hrtimer_cancel(&dfudev->busy_timer);
 	if (retv != dfuIDLE)
 		dev_err(&dfudev->intf->dev, "Need Reset! Stuck in State: %d\n",
 				retv);
+	if (finished && retv == dfuIDLE && dfudev->capbuf)
+		dfu_cache_insert(dfudev->capbuf, dfudev->caplen);
+	else
+		kvfree(dfudev->capbuf);
+	dfudev->capbuf = NULL;
 	usb_free_urb(stctrl->dfurb);
 	usb_free_urb(dfudev->opctrl->dfurb);
-	kfree(dfudev->datbuf);
+	kfree(dfudev->opctrl);
+	usb_free_coherent(dfudev->usbdev, dfudev->xfersize, dfudev->datbuf,
+			dfudev->datdma);
+	complete_all(&dfudev->closed);
+	mutex_unlock(&dfudev->lock);
+}
+
+/*
+ * close() returns at once; dfu_close_work() puts the device back into
+ * dfuIDLE behind it.
+ */
+static int dfu_release(struct inode *inode, struct file *filp)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = filp->private_data;
+	reinit_completion(&dfudev->closed);
+	queue_work(system_unbound_wq, &dfudev->close_work);
 	mutex_unlock(&dfudev->lock);
 	filp->private_data = NULL;
 	return 0;
 }
 
-static ssize_t dfu_upload(struct file *filp, char __user *buff, size_t count,
-			loff_t *f_pos)
+/*
+ * read(), write() and fsync() of a session share datbuf, opctrl and the
+ * coalescing state, and io_uring may run several of them at once.
+ */
+static int dfu_io_lock(struct dfu1_device *dfudev, int nowait)
+{
+	if (nowait)
+		return mutex_trylock(&dfudev->iolock)? 0 : -EAGAIN;
+	return mutex_lock_interruptible(&dfudev->iolock);
+}
+
+static ssize_t dfu_do_upload(struct kiocb *iocb, struct iov_iter *to)
 {
 	struct dfu1_device *dfudev;
 	int blknum, numb;
 	struct dfu_control *opctrl, *stctrl;
-	int dfust, dma, len;
-	dma_addr_t dmabuf;
-	struct device *ctrler;
+	int dfust, len, fast;
+	size_t count;
+	loff_t *f_pos;
 
+	count = iov_iter_count(to);
 	if (count == 0)
 		return 0;
-	dfudev = filp->private_data;
+	f_pos = &iocb->ki_pos;
+	dfudev = iocb->ki_filp->private_data;
 	opctrl = dfudev->opctrl;
 	stctrl = dfudev->stctrl;
+	if (dfudev->ahead.buf)
+		return dfu_ahead_read(dfudev, iocb, to);
+	if (dfudev->dnlen > 0)
+		return -EBUSY;
+	dfust = dfu_wait_busy(dfudev, iocb->ki_flags & IOCB_NOWAIT);
+	if (dfust)
+		return dfust;
 	dfust = dfu_get_state(stctrl);
+	dfu_set_state(dfudev, dfust);
 	if (dfust != dfuIDLE && dfust != dfuUPLOAD_IDLE) {
 		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
 		return -EINVAL;
 	}
 	if (*f_pos != 0 && dfust == dfuIDLE)
 		return 0;
+	if (*f_pos == 0 && dfust == dfuIDLE) {
+		dfust = dfu_ahead_start(dfudev);
+		if (dfust)
+			return dfust;
+		if (dfudev->ahead.buf)
+			return dfu_ahead_read(dfudev, iocb, to);
+	}
 
-	if (!access_ok(buff, count))
-		return -EFAULT;
-
-	ctrler = dfudev->usbdev->bus->controller;
-	dmabuf = ~0;
-	dma = 0;
 	opctrl->req.bRequestType = 0xa1;
 	opctrl->req.bRequest = USB_DFU_UPLOAD;
 	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
 	opctrl->req.wLength = cpu_to_le16(dfudev->xfersize);
 	opctrl->pipe = usb_rcvctrlpipe(dfudev->usbdev, 0);
 	opctrl->len = dfudev->xfersize;
-	if (dfudev->dma) {
-		dmabuf = dma_map_single(ctrler, opctrl->datbuf,
-				dfudev->xfersize, DMA_FROM_DEVICE);
-		if (!dma_mapping_error(ctrler, dmabuf)) {
-			dma = 1;
-			opctrl->dfurb->transfer_flags |=
-						URB_NO_TRANSFER_DMA_MAP;
-			opctrl->dfurb->transfer_dma = dmabuf;
-		} else
-			dev_warn(&dfudev->intf->dev,
-					"Cannot map DMA address\n");
-	}
-
-	blknum = *f_pos / BLKSIZE;
+
+	/*
+	 * In fast mode no GETSTATUS follows the blocks, a short block is
+	 * what tells the upload is over and the device back in dfuIDLE.
+	 */
+	fast = READ_ONCE(fast_upload);
+	blknum = *f_pos / dfudev->xfersize;
 	numb = 0;
 	do {
 		opctrl->req.wValue = cpu_to_le16(blknum);
-		if (dfu_submit_urb(opctrl, urb_timeout) ||
-				dfu_get_status(stctrl))
+		if (dfu_xfer_status(dfudev, !fast))
 			break;
-		dfust = stctrl->dfuStatus.bState;
+		if (fast)
+			dfust = READ_ONCE(opctrl->nxfer) < opctrl->len?
+				dfuIDLE : dfuUPLOAD_IDLE;
+		else
+			dfust = stctrl->dfuStatus.bState;
+		dfu_set_state(dfudev, dfust);
 		if (dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
 			dev_err(&dfudev->intf->dev,
 				"Uploading failed. DFU State: %d\n", dfust);
@@ -278,9 +778,8 @@ static ssize_t dfu_upload(struct file *filp, char __user *buff, size_t count,
 		if (len == 0)
 			break;
 		*f_pos += len;
-		blknum = *f_pos / BLKSIZE;
-		dma_sync_single_for_cpu(ctrler, dmabuf, len, DMA_FROM_DEVICE);
-		if (copy_to_user(buff+numb, opctrl->datbuf, len)) {
+		blknum = *f_pos / dfudev->xfersize;
+		if (copy_to_iter(opctrl->datbuf, len, to) != len) {
 			dev_err(&dfudev->intf->dev,
 				"Failed to copy data into user space!\n");
 			break;
@@ -288,109 +787,248 @@ static ssize_t dfu_upload(struct file *filp, char __user *buff, size_t count,
 		numb += len;
 	} while (numb < count && dfust == dfuUPLOAD_IDLE);
 
-	if (dma)
-		dma_unmap_single(ctrler, dmabuf, dfudev->xfersize,
-				DMA_FROM_DEVICE);
-
 	return numb;
 }
 
-static ssize_t dfu_dnload(struct file *filp, const char __user *buff,
-			size_t count, loff_t *f_pos)
+static ssize_t dfu_upload(struct kiocb *iocb, struct iov_iter *to)
 {
 	struct dfu1_device *dfudev;
-	int blknum, numb, fpos;
-	struct dfu_control *opctrl, *stctrl;
-	int dfust, dma, len, lenrem, tmout;
-	dma_addr_t dmabuf;
-	struct device *ctrler;
+	ssize_t retv;
 
-	if (count == 0)
-		return 0;
-	dfudev = filp->private_data;
-	opctrl = dfudev->opctrl;
-	stctrl = dfudev->stctrl;
-	dfust = dfu_get_state(stctrl);
-	if (dfust != dfuIDLE && dfust != dfuDNLOAD_IDLE) {
-		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
-		return -EINVAL;
+	dfudev = iocb->ki_filp->private_data;
+	retv = dfu_io_lock(dfudev, iocb->ki_flags & IOCB_NOWAIT);
+	if (retv)
+		return retv;
+	retv = dfu_do_upload(iocb, to);
+	mutex_unlock(&dfudev->iolock);
+	return retv;
+}
+
+/*
+ * Keep a copy of everything written in the session, so that the image
+ * can go into the cache once the download has succeeded. Images larger
+ * than the cache are not copied at all.
+ */
+static void dfu_capture(struct dfu1_device *dfudev, const void *data, int len)
+{
+	size_t newsize, limit;
+	u8 *newbuf;
+
+	if (dfudev->capoff)
+		return;
+	if (dfudev->caplen + len > dfudev->capsize) {
+		limit = dfu_cache_limit();
+		newsize = dfudev->capsize? 2 * dfudev->capsize : 64 * 1024;
+		while (newsize < dfudev->caplen + len)
+			newsize *= 2;
+		if (newsize > limit)
+			newsize = limit;
+		newbuf = NULL;
+		if (dfudev->caplen + len <= newsize)
+			newbuf = kvmalloc(newsize, GFP_KERNEL);
+		if (!newbuf) {
+			kvfree(dfudev->capbuf);
+			dfudev->capbuf = NULL;
+			dfudev->capoff = 1;
+			return;
+		}
+		if (dfudev->capbuf)
+			memcpy(newbuf, dfudev->capbuf, dfudev->caplen);
+		kvfree(dfudev->capbuf);
+		dfudev->capbuf = newbuf;
+		dfudev->capsize = newsize;
 	}
-	if (!access_ok(buff, count))
-		return -EFAULT;
+	memcpy(dfudev->capbuf + dfudev->caplen, data, len);
+	dfudev->caplen += len;
+}
 
-	ctrler = dfudev->usbdev->bus->controller;
-	dmabuf = ~0;
-	dma = 0;
-	opctrl->req.bRequestType = 0x21;
-	opctrl->req.bRequest = USB_DFU_DNLOAD;
-	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
-	opctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
-	if (dfudev->dma) {
-		dmabuf = dma_map_single(ctrler, opctrl->datbuf, dfudev->xfersize,
-					DMA_TO_DEVICE);
-		if (!dma_mapping_error(ctrler, dmabuf)) {
-			dma = 1;
-			opctrl->dfurb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-			opctrl->dfurb->transfer_dma = dmabuf;
-		} else
-			dev_warn(&dfudev->intf->dev,
-					"Cannot map DMA address\n");
-	}
-
-	fpos = *f_pos;
-	blknum = fpos / BLKSIZE;
-	lenrem = count;
+/*
+ * Writes are collected in datbuf and only full blocks of xfersize go out,
+ * however userspace chunks its data. The last partial block is sent by
+ * fsync() or close().
+ */
+static ssize_t dfu_do_dnload(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dfu1_device *dfudev;
+	int len, nowait, retv;
+	size_t numb;
+
+	dfudev = iocb->ki_filp->private_data;
+	if (dfudev->ahead.buf)
+		return -EBUSY;
+	if (dfudev->dnerr)
+		return dfudev->dnerr;
+	nowait = iocb->ki_flags & IOCB_NOWAIT;
 	numb = 0;
-	do {
-		opctrl->len = dfudev->xfersize > lenrem ? lenrem :
-							dfudev->xfersize;
-		if (copy_from_user(dfudev->datbuf, buff+numb, opctrl->len))
-			break;
-		opctrl->req.wValue = cpu_to_le16(blknum);
-		opctrl->req.wLength = cpu_to_le16(opctrl->len);
-		dma_sync_single_for_device(ctrler, dmabuf, opctrl->len,
-						DMA_TO_DEVICE);
-		if (dfu_submit_urb(opctrl, urb_timeout) ||
-				dfu_get_status(stctrl))
-			break;
-		len = READ_ONCE(opctrl->nxfer);
-		if (len == 0)
-			break;
-		numb += len;
-		lenrem -= len;
-		fpos += len;
-		blknum = fpos / BLKSIZE;
-		while (stctrl->dfuStatus.bState == dfuDNLOAD_BUSY) {
-			tmout = stctrl->dfuStatus.wmsec[0] |
-					(stctrl->dfuStatus.wmsec[1] << 8) |
-					(stctrl->dfuStatus.wmsec[2] << 16);
-			msleep(tmout);
-			if (dfu_get_status(stctrl))
+	retv = 0;
+	for (;;) {
+		if (dfudev->dnlen == dfudev->xfersize) {
+			retv = dfu_flush_block(dfudev, nowait);
+			if (retv)
 				break;
 		}
-		if (stctrl->dfuStatus.bState != dfuDNLOAD_IDLE &&
-		    stctrl->dfuStatus.bState != dfuIDLE) {
-			dev_err(&dfudev->intf->dev,
-				"Downloading failed. DFU State: %d\n", dfust);
+		if (iov_iter_count(from) == 0)
+			break;
+		len = dfudev->xfersize - dfudev->dnlen;
+		if (len > iov_iter_count(from))
+			len = iov_iter_count(from);
+		if (copy_from_iter(dfudev->datbuf + dfudev->dnlen, len,
+					from) != len) {
+			retv = -EFAULT;
 			break;
 		}
-	} while (lenrem > 0);
-	if (*f_pos != 0 || numb > 32)
-		*f_pos += numb;
+		dfu_capture(dfudev, dfudev->datbuf + dfudev->dnlen, len);
+		dfudev->dnlen += len;
+		numb += len;
+	}
+	if (retv && retv != -EAGAIN && retv != -EFAULT)
+		dfudev->dnerr = retv;
+	iocb->ki_pos += numb;
+	return numb? numb : retv;
+}
 
-	if (dma)
-		dma_unmap_single(ctrler, dmabuf, dfudev->xfersize,
-				DMA_FROM_DEVICE);
+static ssize_t dfu_dnload(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dfu1_device *dfudev;
+	ssize_t retv;
 
-	return numb;
+	dfudev = iocb->ki_filp->private_data;
+	retv = dfu_io_lock(dfudev, iocb->ki_flags & IOCB_NOWAIT);
+	if (retv)
+		return retv;
+	retv = dfu_do_dnload(iocb, from);
+	mutex_unlock(&dfudev->iolock);
+	return retv;
+}
+
+static int dfu_fsync(struct file *filp, loff_t start, loff_t end,
+		int datasync)
+{
+	struct dfu1_device *dfudev;
+	int retv;
+
+	dfudev = filp->private_data;
+	retv = dfu_io_lock(dfudev, 0);
+	if (retv)
+		return retv;
+	if (dfudev->dnerr) {
+		retv = dfudev->dnerr;
+		goto exit_10;
+	}
+	if (dfudev->dnlen > 0)
+		retv = dfu_flush_block(dfudev, 0);
+	if (retv == 0)
+		retv = dfu_wait_busy(dfudev, 0);
+	if (retv)
+		dfudev->dnerr = retv;
+
+exit_10:
+	mutex_unlock(&dfudev->iolock);
+	return retv;
+}
+
+static __poll_t dfu_poll(struct file *filp, poll_table *wait)
+{
+	struct dfu1_device *dfudev;
+	__poll_t mask;
+
+	dfudev = filp->private_data;
+	poll_wait(filp, &dfudev->waitq, wait);
+	if (dfudev->ahead.buf) {
+		if (READ_ONCE(dfudev->ahead.head) != dfudev->ahead.tail ||
+				READ_ONCE(dfudev->ahead.eof) ||
+				READ_ONCE(dfudev->ahead.err))
+			return EPOLLIN | EPOLLRDNORM;
+		return 0;
+	}
+	mask = 0;
+	switch (READ_ONCE(dfudev->dfust)) {
+	case dfuIDLE:
+		mask = EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+		break;
+	case dfuDNLOAD_IDLE:
+		mask = EPOLLOUT | EPOLLWRNORM;
+		break;
+	case dfuDNLOAD_BUSY:
+		if (READ_ONCE(dfudev->dnlen) < dfudev->xfersize ||
+		    !ktime_after(READ_ONCE(dfudev->busy_until), ktime_get()))
+			mask = EPOLLOUT | EPOLLWRNORM;
+		break;
+	case dfuUPLOAD_IDLE:
+		mask = EPOLLIN | EPOLLRDNORM;
+		break;
+	case dfuERROR:
+		mask = EPOLLPRI;
+		break;
+	}
+	return mask;
+}
+
+/*
+ * Switch the session to another transfer size. Block numbers are derived
+ * from it, so this is only allowed between transfers, in dfuIDLE.
+ */
+static int dfu_set_xfersize(struct dfu1_device *dfudev, int size)
+{
+	dma_addr_t datdma;
+	void *datbuf;
+
+	if (!dfu_valid_xfersize(dfudev->usbdev, dfudev->wxfersize, size))
+		return -EINVAL;
+	if (READ_ONCE(dfudev->dfust) != dfuIDLE || dfudev->dnlen > 0 ||
+			dfudev->ahead.buf)
+		return -EBUSY;
+	if (size == dfudev->xfersize)
+		return 0;
+	datbuf = usb_alloc_coherent(dfudev->usbdev, size, GFP_KERNEL, &datdma);
+	if (!datbuf)
+		return -ENOMEM;
+	usb_free_coherent(dfudev->usbdev, dfudev->xfersize, dfudev->datbuf,
+			dfudev->datdma);
+	dfudev->datbuf = datbuf;
+	dfudev->datdma = datdma;
+	dfudev->xfersize = size;
+	dfudev->opctrl->datbuf = datbuf;
+	dfudev->opctrl->dfurb->transfer_dma = datdma;
+	return 0;
+}
+
+static long dfu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct dfu1_device *dfudev;
+	int __user *argp = (int __user *)arg;
+	int size, retv;
+
+	dfudev = filp->private_data;
+	switch (cmd) {
+	case DFU_IOC_GET_XFERSIZE:
+		return put_user(dfudev->xfersize, argp);
+	case DFU_IOC_SET_XFERSIZE:
+		if (get_user(size, argp))
+			return -EFAULT;
+		retv = dfu_io_lock(dfudev, 0);
+		if (retv)
+			return retv;
+		retv = dfu_set_xfersize(dfudev, size);
+		mutex_unlock(&dfudev->iolock);
+		return retv;
+	default:
+		return -ENOTTY;
+	}
 }
 
 static const struct file_operations dfu_fops = {
 	.owner		= THIS_MODULE,
 	.open		= dfu_open,
 	.release	= dfu_release,
-	.read		= dfu_upload,
-	.write		= dfu_dnload
+	.poll		= dfu_poll,
+	.read_iter	= dfu_upload,
+	.write_iter	= dfu_dnload,
+	.fsync		= dfu_fsync,
+	.unlocked_ioctl	= dfu_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write
 };
 
 static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
@@ -403,32 +1041,20 @@ static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
 		return count;
 
 	dfudev = container_of(attr, struct dfu1_device, tachattr);
-	if (!mutex_trylock(&dfudev->lock)) {
+	if (!dfu_trylock(dfudev)) {
 		dev_err(&dfudev->intf->dev,
 				"Cannot send command, device busy\n");
 		return count;
 	}
-	ctrl = kmalloc(sizeof(struct dfu_control) + count, GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		mutex_unlock(&dfudev->lock);
 		return -ENOMEM;
 	}
 
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
-	ctrl->req.bRequestType = 0x21;
-	ctrl->req.bRequest = USB_DFU_DNLOAD;
-	ctrl->req.wValue = 0;
-	ctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
-	ctrl->req.wLength = cpu_to_le16(count);
-	ctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
-	ctrl->datbuf = ctrl + 1;
-	memcpy(ctrl->datbuf, buf, count);
-	ctrl->len = count;
+	memcpy(ctrl->cmd, buf, count);
+	dfu_fill_control(ctrl, USB_DFU_FUNC_DOWN, USB_DFU_DNLOAD, 0,
+			ctrl->cmd, count);
 	if (dfu_submit_urb(ctrl, urb_timeout) ||
 			dfu_get_status(ctrl))
 		dev_err(&dfudev->intf->dev,
@@ -440,8 +1066,7 @@ static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
 				"DFU commmand status: %d, State: %d\n",
 				(int)ctrl->dfuStatus.bStatus,
 				(int)ctrl->dfuStatus.bState);
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_pool_put(&dfudev->pool, ctrl);
 	mutex_unlock(&dfudev->lock);
 	return count;
 }
@@ -472,32 +1097,169 @@ static ssize_t dfu_xfersize_show(struct device *dev,
 	struct dfu1_device *dfudev;
 
 	dfudev = container_of(attr, struct dfu1_device, xsizeattr);
-	return sprintf(buf, "%d\n", dfudev->xfersize);
+	return sprintf(buf, "%d\n", READ_ONCE(dfudev->defxfersize));
 }
 
+static ssize_t dfu_xfersize_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dfu1_device *dfudev;
+	int size, retv;
+
+	dfudev = container_of(attr, struct dfu1_device, xsizeattr);
+	retv = kstrtoint(buf, 0, &size);
+	if (retv)
+		return retv;
+	if (!dfu_valid_xfersize(dfudev->usbdev, dfudev->wxfersize, size)) {
+		dev_err(&dfudev->intf->dev, "Invalid transfer size: %d\n",
+				size);
+		return -EINVAL;
+	}
+	WRITE_ONCE(dfudev->defxfersize, size);
+	return count;
+}
+
+static ssize_t dfu_readahead_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(attr, struct dfu1_device, raattr);
+	return sprintf(buf, "%d\n", READ_ONCE(dfudev->defradepth));
+}
+
+static ssize_t dfu_readahead_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dfu1_device *dfudev;
+	int depth, retv;
+
+	dfudev = container_of(attr, struct dfu1_device, raattr);
+	retv = kstrtoint(buf, 0, &depth);
+	if (retv)
+		return retv;
+	if (depth < 0 || depth > DFU_RA_MAXDEPTH)
+		return -EINVAL;
+	WRITE_ONCE(dfudev->defradepth, depth);
+	return count;
+}
+
+static ssize_t dfu_cache_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return dfu_cache_show(buf);
+}
+
+static ssize_t dfu_flash_cached(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_control *ctrl;
+	struct dfu_image *img;
+	u8 digest[DFU_DIGEST_SIZE];
+	int retv;
+
+	dfudev = container_of(attr, struct dfu1_device, flashattr);
+	if (count < 2 * DFU_DIGEST_SIZE ||
+			hex2bin(digest, buf, DFU_DIGEST_SIZE))
+		return -EINVAL;
+	img = dfu_cache_get(digest);
+	if (!img)
+		return -ENOENT;
+	if (!dfu_trylock(dfudev)) {
+		dfu_cache_put(img);
+		return -EBUSY;
+	}
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		retv = -ENOMEM;
+		goto exit_10;
+	}
+	dfu_stats_begin(&dfudev->stats);
+	retv = dfu_dnload_buffer(ctrl, img->data, img->size,
+			READ_ONCE(dfudev->defxfersize), urb_timeout);
+	dfu_stats_end(&dfudev->stats);
+	dfu_set_state(dfudev, retv);
+	dfu_pool_put(&dfudev->pool, ctrl);
+	if (retv == dfuMANIFEST_WAIT_RESET)
+		usb_queue_reset_device(dfudev->intf);
+	if (retv >= 0)
+		dev_info(&dfudev->intf->dev, "Cached image flashed, %zu bytes\n",
+				img->size);
+
+exit_10:
+	mutex_unlock(&dfudev->lock);
+	dfu_cache_put(img);
+	return retv < 0? retv : count;
+}
+
+static ssize_t dfu_sweep_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_control *ctrl;
+	ssize_t retv;
+
+	dfudev = container_of(attr, struct dfu1_device, sweepattr);
+	if (!dfudev->upload)
+		return -EOPNOTSUPP;
+	if (!dfu_trylock(dfudev))
+		return -EBUSY;
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		mutex_unlock(&dfudev->lock);
+		return -ENOMEM;
+	}
+	retv = dfu_xfersize_sweep(ctrl, dfudev->wxfersize, urb_timeout, buf);
+	dfu_pool_put(&dfudev->pool, ctrl);
+	mutex_unlock(&dfudev->lock);
+	return retv;
+}
+
+/*
+ * The state as last seen by the I/O path; write "1" to refresh to ask
+ * the device again.
+ */
 static ssize_t dfu_state_show(struct device *dev, struct device_attribute *attr,
 			char *buf)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_snapval snap;
+
+	dfudev = container_of(attr, struct dfu1_device, statattr);
+	dfu_snap_read(&dfudev->stats, &snap);
+	if (snap.when == 0)
+		snap.bstate = READ_ONCE(dfudev->dfust);
+	return sprintf(buf, "%d\n", snap.bstate);
+}
+
+static ssize_t dfu_refresh_cmd(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
 {
 	struct dfu1_device *dfudev;
 	struct dfu_control *ctrl;
 	int dfstat;
 
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	dfudev = container_of(attr, struct dfu1_device, statattr);
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
+	dfudev = container_of(attr, struct dfu1_device, refreshattr);
+	if (count < 1 || *buf != '1') {
+		dev_warn(&dfudev->intf->dev, "Invalid command: %c\n", *buf);
+		return count;
+	}
+
+	if (!dfu_trylock(dfudev))
+		return -EBUSY;
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		mutex_unlock(&dfudev->lock);
 		return -ENOMEM;
 	}
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
 	dfstat = dfu_get_state(ctrl);
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
-	return sprintf(buf, "%d\n", dfstat);
+	dfu_pool_put(&dfudev->pool, ctrl);
+	if (dfstat >= 0)
+		dfu_set_state(dfudev, dfstat);
+	mutex_unlock(&dfudev->lock);
+	return dfstat < 0? dfstat : count;
 }
 
 static ssize_t stellaris_show(struct dfu1_device *dfudev,
@@ -539,24 +1301,20 @@ static ssize_t dfu_query_show(struct device *dev, struct device_attribute *attr,
 	dfudev = container_of(attr, struct dfu1_device, queryattr);
 	idVendor = le16_to_cpu(dfudev->usbdev->descriptor.idVendor);
 	idProduct = le16_to_cpu(dfudev->usbdev->descriptor.idProduct);
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
+	if (!dfu_trylock(dfudev))
+		return -EBUSY;
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		mutex_unlock(&dfudev->lock);
 		return -ENOMEM;
 	}
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
 	numbytes = 0;
 	if (idVendor == USB_VENDOR_LUMINARY &&
 	    idProduct == USB_PRODUCT_STELLARIS_DFU)
 		numbytes = stellaris_show(dfudev, ctrl, buf);
 
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_pool_put(&dfudev->pool, ctrl);
+	mutex_unlock(&dfudev->lock);
 	return numbytes;
 }
 
@@ -573,18 +1331,16 @@ static ssize_t dfu_clear_cmd(struct device *dev, struct device_attribute *attr,
 		return count;
 	}
 
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
+	if (!dfu_trylock(dfudev)) {
+		dev_err(&dfudev->intf->dev,
+				"Cannot clear, device busy\n");
+		return -EBUSY;
+	}
+	ctrl = dfu_pool_get(&dfudev->pool);
+	if (!ctrl) {
+		mutex_unlock(&dfudev->lock);
 		return -ENOMEM;
 	}
-
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
 	dfust = dfu_get_state(ctrl);
 	switch (dfust) {
 	case dfuDNLOAD_IDLE:
@@ -599,11 +1355,29 @@ static ssize_t dfu_clear_cmd(struct device *dev, struct device_attribute *attr,
 				dfust);
 		break;
 	}
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_pool_put(&dfudev->pool, ctrl);
+	mutex_unlock(&dfudev->lock);
 	return count;
 }
 
+static ssize_t dfu_pool_stat_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(attr, struct dfu1_device, poolattr);
+	return dfu_pool_show(&dfudev->pool, buf);
+}
+
+static ssize_t dfu_rto_stat_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(attr, struct dfu1_device, rtoattr);
+	return dfu_rto_show(&dfudev->rto, NULL, buf);
+}
+
 static int dfu_create_attrs(struct dfu1_device *dfudev)
 {
 	int retv = 0;
@@ -639,9 +1413,9 @@ static int dfu_create_attrs(struct dfu1_device *dfudev)
 		goto err_20;
 	}
 	dfudev->xsizeattr.attr.name = "xfersize";
-	dfudev->xsizeattr.attr.mode = 0444;
+	dfudev->xsizeattr.attr.mode = 0644;
 	dfudev->xsizeattr.show = dfu_xfersize_show;
-	dfudev->xsizeattr.store = NULL;
+	dfudev->xsizeattr.store = dfu_xfersize_store;
 	retv = device_create_file(&dfudev->intf->dev, &dfudev->xsizeattr);
 	if (retv != 0) {
 		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
@@ -678,9 +1452,93 @@ static int dfu_create_attrs(struct dfu1_device *dfudev)
 				retv);
 		goto err_60;
 	}
+	dfudev->poolattr.attr.name = "pool";
+	dfudev->poolattr.attr.mode = 0444;
+	dfudev->poolattr.show = dfu_pool_stat_show;
+	dfudev->poolattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->poolattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_70;
+	}
+	dfudev->sweepattr.attr.name = "sweep";
+	dfudev->sweepattr.attr.mode = 0400;
+	dfudev->sweepattr.show = dfu_sweep_show;
+	dfudev->sweepattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->sweepattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_80;
+	}
+	dfudev->raattr.attr.name = "readahead";
+	dfudev->raattr.attr.mode = 0644;
+	dfudev->raattr.show = dfu_readahead_show;
+	dfudev->raattr.store = dfu_readahead_store;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->raattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_90;
+	}
+	dfudev->cacheattr.attr.name = "cache";
+	dfudev->cacheattr.attr.mode = 0444;
+	dfudev->cacheattr.show = dfu_cache_stat_show;
+	dfudev->cacheattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->cacheattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_100;
+	}
+	dfudev->flashattr.attr.name = "flash_cached";
+	dfudev->flashattr.attr.mode = 0200;
+	dfudev->flashattr.show = NULL;
+	dfudev->flashattr.store = dfu_flash_cached;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->flashattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_110;
+	}
+	dfudev->rtoattr.attr.name = "urb_timeouts";
+	dfudev->rtoattr.attr.mode = 0444;
+	dfudev->rtoattr.show = dfu_rto_stat_show;
+	dfudev->rtoattr.store = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->rtoattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_120;
+	}
+	dfudev->refreshattr.attr.name = "refresh";
+	dfudev->refreshattr.attr.mode = 0200;
+	dfudev->refreshattr.store = dfu_refresh_cmd;
+	dfudev->refreshattr.show = NULL;
+	retv = device_create_file(&dfudev->intf->dev, &dfudev->refreshattr);
+	if (retv != 0) {
+		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
+				retv);
+		goto err_130;
+	}
 
 	return retv;
 
+err_130:
+	device_remove_file(&dfudev->intf->dev, &dfudev->rtoattr);
+err_120:
+	device_remove_file(&dfudev->intf->dev, &dfudev->flashattr);
+err_110:
+	device_remove_file(&dfudev->intf->dev, &dfudev->cacheattr);
+err_100:
+	device_remove_file(&dfudev->intf->dev, &dfudev->raattr);
+err_90:
+	device_remove_file(&dfudev->intf->dev, &dfudev->sweepattr);
+err_80:
+	device_remove_file(&dfudev->intf->dev, &dfudev->poolattr);
+err_70:
+	device_remove_file(&dfudev->intf->dev, &dfudev->queryattr);
 err_60:
 	device_remove_file(&dfudev->intf->dev, &dfudev->abortattr);
 err_50:
@@ -698,6 +1556,13 @@ err_10:
 
 static void dfu_remove_attrs(struct dfu1_device *dfudev)
 {
+	device_remove_file(&dfudev->intf->dev, &dfudev->refreshattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->rtoattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->flashattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->cacheattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->raattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->sweepattr);
+	device_remove_file(&dfudev->intf->dev, &dfudev->poolattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->queryattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->abortattr);
 	device_remove_file(&dfudev->intf->dev, &dfudev->statattr);
@@ -733,7 +1598,7 @@ static int dfu_probe(struct usb_interface *intf,
 		retv = -ENODEV;
 		goto err_05;
 	}
-	dfudev = kmalloc(sizeof(struct dfu1_device), GFP_KERNEL);
+	dfudev = kzalloc(sizeof(struct dfu1_device), GFP_KERNEL);
 	if (!dfudev) {
 		retv = -ENOMEM;
 		goto err_05;
@@ -744,19 +1609,40 @@ static int dfu_probe(struct usb_interface *intf,
 	dfudev->detach = (dfufdsc->attr & 0x08) ? 1 : 0;
 	dfudev->dettmout = le16_to_cpu(dfufdsc->tmout);
 	dfudev->xfersize = le16_to_cpu(dfufdsc->xfersize);
+	dfudev->wxfersize = dfudev->xfersize;
+	dfudev->defxfersize = dfudev->xfersize;
 	dfudev->intf = intf;
 	dfudev->usbdev = interface_to_usbdev(intf);
 	dfudev->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
 	dfudev->proto = 2;
-	if (dfudev->usbdev->bus->controller->dma_mask)
-		dfudev->dma = 1;
-	else
-		dfudev->dma = 0;
+	init_usb_anchor(&dfudev->submitted);
+	init_waitqueue_head(&dfudev->waitq);
+	hrtimer_init(&dfudev->busy_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dfudev->busy_timer.function = dfu_busy_expired;
+	spin_lock_init(&dfudev->ahead.lock);
+	INIT_WORK(&dfudev->ahead.work, dfu_ahead_work);
+	INIT_WORK(&dfudev->close_work, dfu_close_work);
+	init_completion(&dfudev->closed);
+	complete_all(&dfudev->closed);
+	dfudev->defradepth = DFU_RA_DEPTH;
+	dfudev->dfust = appIDLE;
 	mutex_init(&dfudev->lock);
+	mutex_init(&dfudev->iolock);
+	retv = dfu_pool_init(&dfudev->pool, intf, DFU_POOL_SIZE);
+	if (retv)
+		goto err_10;
+	dfu_rto_init(&dfudev->rto, urb_timeout);
+	dfudev->pool.rto = &dfudev->rto;
+	retv = dfu_stats_init(&dfudev->stats, intf, NULL);
+	if (retv)
+		goto err_12;
+	dfudev->pool.stats = &dfudev->stats;
+	dfudev->pacer.stats = &dfudev->stats;
+	dfudev->stats.notify = "state";
 
 	retv = dfu_create_attrs(dfudev);
 	if (retv)
-		goto err_10;
+		goto err_14;
 
         for (i = 0; i < max_dfus; i++)
                 if (!atomic_xchg(dev_minors+i, 1))
@@ -793,6 +1679,10 @@ err_20:
 	atomic_set(dev_minors+MINOR(dfudev->devno), 0);
 err_15:
 	dfu_remove_attrs(dfudev);
+err_14:
+	dfu_stats_destroy(&dfudev->stats);
+err_12:
+	dfu_pool_destroy(&dfudev->pool);
 err_10:
 	kfree(dfudev);
 err_05:
@@ -806,10 +1696,17 @@ static void dfu_disconnect(struct usb_interface *intf)
 
 	dfudev = usb_get_intfdata(intf);
 	usb_set_intfdata(intf, NULL);
+	flush_work(&dfudev->close_work);
+	WRITE_ONCE(dfudev->ahead.stop, 1);
+	cancel_work_sync(&dfudev->ahead.work);
+	usb_kill_anchored_urbs(&dfudev->submitted);
+	hrtimer_cancel(&dfudev->busy_timer);
 	device_destroy(dfu_class, dfudev->devno);
 	cdev_del(&dfudev->cdev);
 	atomic_set(dev_minors+MINOR(dfudev->devno), 0);
 	dfu_remove_attrs(dfudev);
+	dfu_stats_destroy(&dfudev->stats);
+	dfu_pool_destroy(&dfudev->pool);
 	kfree(dfudev);
 	atomic_dec(&dfu_index);
 }
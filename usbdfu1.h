@@ -9,10 +9,40 @@
  *
 */
 #include <linux/cdev.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include "usbdfu.h"
 
+#define DFU_RA_DEPTH	4
+#define DFU_RA_MAXDEPTH	32
+
+/*
+ * Upload readahead ring. A worker keeps fetching UPLOAD blocks into the
+ * slots of one coherent buffer while read() consumes them. head and tail
+ * count produced and consumed blocks, the slot is the count modulo depth.
+ */
+struct dfu_ahead {
+	spinlock_t lock;
+	struct work_struct work;
+	void *buf;
+	dma_addr_t dma;
+	int *lens;
+	int depth;
+	int head;
+	int tail;
+	int pos;		/* bytes already read from the tail slot */
+	int blknum;
+	int fast;
+	int eof;
+	int err;
+	int stop;
+};
+
 struct dfu1_device {
 	struct mutex lock;
+	struct mutex iolock;	/* serializes the I/O calls of a session */
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
 	struct device *sysdev;
@@ -23,20 +53,49 @@ struct dfu1_device {
 	struct device_attribute statattr;
 	struct device_attribute abortattr;
 	struct device_attribute queryattr;
+	struct device_attribute poolattr;
+	struct device_attribute sweepattr;
+	struct device_attribute raattr;
+	struct device_attribute cacheattr;
+	struct device_attribute flashattr;
+	struct device_attribute rtoattr;
+	struct device_attribute refreshattr;
 	struct {
 		unsigned int download:1;
 		unsigned int upload:1;
 		unsigned int manifest:1;
 		unsigned int detach:1;
 	};
+	struct usb_anchor submitted;
+	struct dfu_pool pool;
+	struct dfu_rto rto;
+	struct dfu_stats stats;
 	struct dfu_control *opctrl, *stctrl;
 	void *datbuf;
+	dma_addr_t datdma;
+	ktime_t busy_until;
+	struct hrtimer busy_timer;
+	struct dfu_pacer pacer;
+	wait_queue_head_t waitq;
+	int dfust;
+	int dnlen;		/* bytes waiting in datbuf for a full block */
+	int dnblk;
+	int dnerr;
+	u8 *capbuf;		/* copy of the image for the cache */
+	size_t caplen;
+	size_t capsize;
+	int capoff;
+	struct dfu_ahead ahead;
+	struct work_struct close_work;
+	struct completion closed;	/* no cleanup of a session pending */
+	int defradepth;		/* set through sysfs, used by the next upload */
 	dev_t devno;
 	int dettmout;
-	int xfersize;
+	int xfersize;		/* of the open session */
+	int wxfersize;		/* wTransferSize of the descriptor */
+	int defxfersize;	/* set through sysfs, used by the next open */
 	int proto;
 	int intfnum;
-	int dma;
 	struct cdev cdev;
 };
 #endif /* LINUX_USB_DFU_1_DSCAO__ */